@@ -24,18 +24,44 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// SIMD kernels for bitmap rows (x86-64 has SSE2, and maybe AVX2)
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(IMAGEBW_NO_SIMD)
+#define BITMAP_SIMD
+#include <immintrin.h>
+#endif
 
 #include "instrumentation.h"
 
 // The data structure
 //
-// A BW image is stored in a structure containing 3 fields:
+// A BW image is stored in a structure containing the following fields:
 // Two integers store the image width and height.
-// The other field is a pointer to an array that stores the pointers
-// to the RLE compressed image rows.
+// The row field is a pointer to an array (the row table) that stores, for
+// each row, the value of its first pixel and a pointer to its RLE runs.
+// The compressed rows themselves are not allocated one by one: they are
+// carved, in order, out of a few large blocks of memory (the arena).
+// Creating an image thus costs a handful of allocations, regardless of its
+// height, and walking the rows top to bottom touches memory sequentially.
+//
+// Optionally, an image may also keep a hash table of its distinct rows
+// (see ImageSetRowInterning), so that repeated rows are stored only once.
+//
+// Stored rows are immutable, so images may share them: arena blocks are
+// reference counted, and each image keeps a reference to every block
+// holding one of its rows. Operations that only reorder or reuse rows
+// (NEG, the horizontal mirror, replication at the bottom, copies) thus
+// just fill a new row table, and a row is only copied when an operation
+// produces a different one.
 //
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -44,15 +70,125 @@
 // Constant value --- Use them throughout your code
 // const uint8 BLACK = 1;  // Black pixel value, defined on .h
 // const uint8 WHITE = 0;  // White pixel value, defined on .h
-const int EOR = -1;  // Stored as the last element of a RLE row
+const int EOR = -1;  // Printed as the last element of a RLE row
+
+// Run encodings
+// The runs of a row are stored in the most compact of these encodings
+// (see StoreRLERow):
+#define RUN8 0    // 1 byte per run (all runs shorter than 256 pixels)
+#define RUN16 1   // 2 bytes per run (all runs shorter than 65536 pixels)
+#define RUNVAR 2  // LEB128 varint: 7 bits per byte, low bits first, with
+                  // the top bit set on every byte but the last of each run
+#define BITMAP 3  // not runs, but the pixels themselves, 1 bit per pixel
+#define RUN32 4   // 4 bytes per run, in native order: only for the scratch
+                  // rows of operations, never stored in an arena
+
+// A BITMAP row is better for dense content (e.g., halftones or noise),
+// where there are nearly as many runs as pixels.
+// Its bits are in PBM order (the top bit of each byte first), padded with
+// zeros to a whole number of 64-bit words, so that boolean operations
+// work on whole words (see BitmapOp).
+// Like the runs, the bits are relative to the first pixel (whose color is
+// kept in the row table): bit x is 1 iff pixel x differs from pixel 0.
+// So the first bit is always 0, and equal rows have equal bits.
+
+// A compressed RLE row is stored as a header immediately followed by
+// the size bytes of its encoded runs.
+// Since the header gives the number of runs, no EOR sentinel is stored
+// and the size of the row is known without scanning it.
+typedef struct {
+  uint32 num_runs;  // number of runs
+  uint32 size;      // number of bytes of encoded runs after the header
+  uint8 enc;        // encoding of the runs: RUN8, RUN16, RUNVAR or BITMAP
+  uint8 unused[3];  // always 0 (so that headers may be compared bytewise)
+} RowHeader;
+
+// An entry of the row table.
+// The value of the first pixel is kept here, and not with the runs,
+// so that an image and its negative can share the runs.
+typedef struct {
+  const RowHeader* rle;  // the runs (may be shared with other images)
+  uint8 color;           // value of the first pixel
+} RowRef;
+
+// Rows are stored in the arena at multiples of ROW_ALIGN bytes
+#define ROW_ALIGN 4
+
+// A block of memory from which RLE rows are allocated.
+// The arena grows by adding blocks, so rows are never moved.
+typedef struct arena Arena;
+struct arena {
+  uint32 refcount;  // number of images referencing the block
+  size_t size;      // capacity of the block, in bytes
+  size_t used;      // number of bytes already handed out
+  uint8 data[];
+};
 
 // Internal structure for storing RLE BW images
 struct image {
   uint32 width;
   uint32 height;
-  int** row;  // pointer to an array of pointers referencing the compressed rows
+  RowRef* row;         // the row table
+  Arena** arena;       // the arena blocks referenced by the rows
+  uint32 num_arenas;   // number of blocks in the arena array
+  uint32 max_arenas;   // capacity of the arena array
+  Arena* fill;         // block where new rows are stored (owned by the image)
+  Arena* spare;        // an empty block kept for reuse (not in the arena array)
+  size_t garbage;      // bytes of replaced rows in blocks only the image uses
+  struct rowdict* dict;  // distinct rows stored by the image (if interning)
+  uint64* row_hash;    // hash of each row, computed when first needed (or NULL)
+  uint64 hash;         // hash of the image (valid if row_hash is not NULL)
+  uint32* row_black;   // number of BLACK pixels of each row, if known (or NULL)
+  uint64 black;        // number of BLACK pixels (valid if row_black is not NULL)
+  struct pixelindex* index;  // run ends of the rows probed (or NULL)
+  struct rowuses* uses;  // number of rows using each stored row (or NULL)
 };
 
+// The positions where the runs of a row end, in increasing order, so that
+// a pixel is found by a binary search.
+// They are computed for each row when a pixel of it is first probed.
+typedef struct pixelindex {
+  uint32* ends;      // the run ends of the probed rows, one after another
+  size_t used;       // number of entries of ends in use
+  size_t size;       // capacity of ends
+  size_t dead;       // entries of replaced rows (at least), not used
+  size_t start[];    // for each row: 1 + position of its ends, or 0
+} PixelIndex;
+
+// Hash table of the distinct rows stored by an image (open addressing)
+typedef struct rowdict {
+  uint32 capacity;  // number of slots (a power of 2)
+  uint32 count;     // number of rows in the table
+  struct {
+    uint64 hash;
+    const RowHeader* rle;  // NULL for empty slots
+  } slot[];
+} RowDict;
+
+// The number of rows of an image that use each row it stores, by address
+// (open addressing).
+// They are counted when a row of the image is first replaced, and tell
+// which replaced rows are no longer used.
+typedef struct rowuses {
+  uint32 capacity;  // number of slots (a power of 2)
+  uint32 count;     // number of slots in use (some may have no uses left)
+  struct {
+    const RowHeader* rle;  // NULL for empty slots
+    uint32 uses;
+  } slot[];
+} RowUses;
+
+// Are new images interning their rows?
+static int intern_rows = 0;
+
+// Number of threads of row-parallel operations
+static uint32 num_threads = 1;
+
+#ifdef BITMAP_SIMD
+// Does the processor support AVX2? (Set by ImageInit.)
+static int have_avx2 = 0;
+#endif
+
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
 
@@ -83,6 +219,34 @@ void ImageInit(void) {  ///
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   // Name other counters here...
   InstrName[1] = "num_ands"; // InstrCount[1] contará o números de operações &&
+
+  const char* intern = getenv("IMAGEBW_INTERN");
+  if (intern != NULL) ImageSetRowInterning(atoi(intern));
+
+#ifdef BITMAP_SIMD
+  have_avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+
+  const char* threads = getenv("IMAGEBW_THREADS");
+  if (threads != NULL) ImageSetThreads((uint32)atoi(threads));
+}
+
+/// Enable or disable row interning for images created afterwards.
+void ImageSetRowInterning(int enable) {  ///
+  intern_rows = enable != 0;
+}
+
+static void StopPool(void);
+
+/// Set the number of threads of row-parallel operations.
+/// With 0, use as many threads as online processors.
+void ImageSetThreads(uint32 n) {  ///
+  if (n == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = cpus > 0 ? (uint32)cpus : 1;
+  }
+  StopPool();
+  num_threads = n;
 }
 
 // Macros to simplify accessing instrumentation counters:
@@ -93,9 +257,165 @@ void ImageInit(void) {  ///
 
 /// Auxiliary (static) functions
 
+/// Allocate a new arena block, able to hold (at least) size bytes
+static Arena* AllocateArenaBlock(size_t size) {
+  Arena* block = malloc(sizeof(Arena) + size);
+  check(block != NULL, "malloc");
+
+  block->refcount = 0;
+  block->size = size;
+  block->used = 0;
+
+  return block;
+}
+
+/// Add a reference to block to the arena of image img
+/// (unless the image already references it)
+static void AddArenaBlock(Image img, Arena* block) {
+  for (uint32 i = 0; i < img->num_arenas; i++) {
+    if (img->arena[i] == block) return;
+  }
+  if (img->num_arenas == img->max_arenas) {
+    img->max_arenas = img->max_arenas == 0 ? 4 : 2 * img->max_arenas;
+    img->arena = realloc(img->arena, img->max_arenas * sizeof(Arena*));
+    check(img->arena != NULL, "realloc");
+  }
+  img->arena[img->num_arenas++] = block;
+  block->refcount++;
+}
+
+/// Make image dst reference all arena blocks of image src,
+/// so that dst may use the rows of src
+static void ShareArena(Image dst, const Image src) {
+  for (uint32 i = 0; i < src->num_arenas; i++) {
+    AddArenaBlock(dst, src->arena[i]);
+  }
+}
+
+/// Number of bytes stored in all the arena blocks of an image
+static size_t ArenaUsed(const Image img) {
+  size_t used = 0;
+  for (uint32 i = 0; i < img->num_arenas; i++) {
+    used += img->arena[i]->used;
+  }
+  return used;
+}
+
+/// Drop the reference of image img to an arena block.
+/// When no image references the block any longer, it is kept as the
+/// spare block of img (if it is the largest one seen), or freed.
+static void ReleaseArenaBlock(Image img, Arena* block) {
+  assert(block->refcount > 0);
+  if (--block->refcount > 0) return;
+
+  if (img->spare == NULL || img->spare->size < block->size) {
+    free(img->spare);
+    block->used = 0;
+    img->spare = block;
+  } else {
+    free(block);
+  }
+}
+
+/// Drop the references of image img to the first n blocks of its arena
+static void ReleaseArena(Image img, uint32 n) {
+  assert(n <= img->num_arenas);
+  if (n == 0) return;
+  for (uint32 i = 0; i < n; i++) {
+    ReleaseArenaBlock(img, img->arena[i]);
+  }
+  memmove(img->arena, img->arena + n, (img->num_arenas - n) * sizeof(Arena*));
+  img->num_arenas -= n;
+}
+
+/// Forget the rows interned by image img (they are about to be replaced)
+static void ClearRowDict(Image img) {
+  RowDict* dict = img->dict;
+  if (dict != NULL) {
+    memset(dict->slot, 0, dict->capacity * sizeof(dict->slot[0]));
+    dict->count = 0;
+  }
+}
+
+/// Forget what is known about the rows of image img: their hashes,
+/// their numbers of BLACK pixels, their run ends and their uses (the rows
+/// are about to change)
+static void ForgetRowCaches(Image img) {
+  free(img->row_hash);
+  img->row_hash = NULL;
+  free(img->row_black);
+  img->row_black = NULL;
+  if (img->index != NULL) {
+    free(img->index->ends);
+    free(img->index);
+    img->index = NULL;
+  }
+  free(img->uses);
+  img->uses = NULL;
+}
+
+// The number of BLACK pixels of the rows of an image is computed when first
+// needed, or derived by operations from those of their operands.
+
+/// Set the numbers of BLACK pixels of the rows of img to row_black
+/// (an array of height counts, now owned by img, or NULL if unknown)
+static void SetCounts(Image img, uint32* row_black) {
+  if (img->row_black != row_black) free(img->row_black);
+  img->row_black = row_black;
+  img->black = 0;
+  if (row_black != NULL) {
+    for (uint32 i = 0; i < img->height; i++) img->black += row_black[i];
+  }
+}
+
+/// A new (uninitialized) array of counts for the rows of an image
+static uint32* NewCounts(uint32 height) {
+  uint32* row_black = malloc(height * sizeof(uint32));
+  check(row_black != NULL, "malloc");
+  return row_black;
+}
+
+/// A copy of the counts of the rows of img (or NULL if unknown)
+static uint32* CopyCounts(const Image img) {
+  if (img->row_black == NULL) return NULL;
+  uint32* row_black = NewCounts(img->height);
+  memcpy(row_black, img->row_black, img->height * sizeof(uint32));
+  return row_black;
+}
+
+/// Start storing a new set of rows in image img, reusing its storage.
+/// New rows go to the spare block of img or, if there is none,
+/// to a new block able to hold capacity bytes.
+/// The blocks of the old rows stay referenced (the old rows may be
+/// operands of the operation that replaces them) until ReleaseArena(img, n)
+/// is called with the number n returned here.
+static uint32 RestartArena(Image img, size_t capacity) {
+  uint32 num_old = img->num_arenas;
+
+  Arena* block = img->spare;
+  img->spare = NULL;
+  if (block == NULL && capacity > 0) {
+    block = AllocateArenaBlock(capacity);
+  }
+  img->fill = block;
+  if (block != NULL) {
+    AddArenaBlock(img, block);
+  }
+  img->garbage = 0;
+
+  ClearRowDict(img);
+  ForgetRowCaches(img);
+
+  return num_old;
+}
+
 /// Create the header of an image data structure
-/// And allocate the array of pointers to RLE rows
-static Image AllocateImageHeader(uint32 width, uint32 height) {
+/// And allocate the row table
+/// and an arena able to hold (at least) capacity bytes of RLE rows.
+/// If the capacity is not known in advance, an estimate will do:
+/// the arena grows as needed.
+/// With capacity 0, no block is allocated until a row is stored.
+static Image AllocateImageHeader(uint32 width, uint32 height, size_t capacity) {
   assert(width > 0 && height > 0);
   Image newHeader = malloc(sizeof(struct image));
   check(newHeader != NULL, "malloc");
@@ -103,125 +423,746 @@ static Image AllocateImageHeader(uint32 width, uint32 height) {
   newHeader->width = width;
   newHeader->height = height;
 
-  // Allocating the array of pointers to RLE rows
-  newHeader->row = malloc(height * sizeof(int*));
+  // Allocating the row table
+  newHeader->row = malloc(height * sizeof(RowRef));
   check(newHeader->row != NULL, "malloc");
 
+  newHeader->arena = NULL;
+  newHeader->num_arenas = 0;
+  newHeader->max_arenas = 0;
+  newHeader->fill = NULL;
+  newHeader->spare = NULL;
+  newHeader->garbage = 0;
+  newHeader->dict = NULL;
+  newHeader->row_hash = NULL;
+  newHeader->row_black = NULL;
+  newHeader->index = NULL;
+  newHeader->uses = NULL;
+  if (capacity > 0) {
+    newHeader->fill = AllocateArenaBlock(capacity);
+    AddArenaBlock(newHeader, newHeader->fill);
+  }
+
   return newHeader;
 }
 
-/// Allocate an array to store a RLE row with n elements
-static int* AllocateRLERowArray(uint32 n) {
-  assert(n > 2);
-  int* newArray = malloc(n * sizeof(int));
-  check(newArray != NULL, "malloc");
+/// Number of bytes of a stored RLE row (header and runs)
+static size_t GetSizeRLERow(const RowHeader* RLE_row) {
+  return sizeof(RowHeader) + RLE_row->size;
+}
+
+/// Allocate, from the arena of image img, room for a RLE row
+/// with size bytes of encoded runs.
+/// Only the size field of the header is set.
+static RowHeader* AllocateRLERow(Image img, uint32 size) {
+  size_t n = sizeof(RowHeader) + size;
+  n = (n + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+
+  Arena* block = img->fill;
+  if (block == NULL || block->size - block->used < n) {
+    // Out of space: start a new block, twice as large as the previous one,
+    // so that the number of blocks grows only logarithmically
+    size_t size = block == NULL ? 4096 : 2 * block->size;
+    if (size < n) size = n;
+    block = img->fill = AllocateArenaBlock(size);
+    AddArenaBlock(img, block);
+  }
+  RowHeader* newRow = (RowHeader*)(block->data + block->used);
+  block->used += n;
+
+  newRow->size = size;
+  memset(newRow->unused, 0, sizeof(newRow->unused));
+  return newRow;
+}
+
+/// A 64-bit hash of n bytes.
+/// (Mixes 8 bytes at a time, with multiply-and-rotate steps.)
+static uint64 HashBytes(const void* data, size_t n) {
+  const uint64 k1 = 0x9E3779B97F4A7C15ull;
+  const uint64 k2 = 0xC2B2AE3D27D4EB4Full;
+  const uint8* p = data;
+  uint64 h = k1 ^ (n * k2);
+  uint64 w;
+  while (n >= 8) {
+    memcpy(&w, p, 8);
+    h ^= w * k2;
+    h = ((h << 31) | (h >> 33)) * k1;
+    p += 8;
+    n -= 8;
+  }
+  if (n > 0) {
+    w = 0;
+    memcpy(&w, p, n);
+    h ^= w * k2;
+    h = ((h << 31) | (h >> 33)) * k1;
+  }
+  // Final avalanche
+  h ^= h >> 33;
+  h *= k2;
+  h ^= h >> 29;
+  return h;
+}
 
-  return newArray;
+/// Allocate an empty row dictionary with the given number of slots
+static RowDict* AllocateRowDict(uint32 capacity) {
+  RowDict* dict = calloc(1, sizeof(RowDict) + capacity * sizeof(dict->slot[0]));
+  check(dict != NULL, "calloc");
+  dict->capacity = capacity;
+  return dict;
 }
 
-/// Compute the number of runs of a non-compressed (RAW) image row
-static uint32 GetNumRunsInRAWRow(uint32 image_width, const uint8* RAW_row) {
-  assert(image_width > 0);
-  assert(RAW_row != NULL);
+/// Insert a row into a dictionary (with room for it), given its hash
+static void RowDictInsert(RowDict* dict, uint64 hash, const RowHeader* rle) {
+  uint32 i = (uint32)hash & (dict->capacity - 1);
+  while (dict->slot[i].rle != NULL) {
+    i = (i + 1) & (dict->capacity - 1);
+  }
+  dict->slot[i].hash = hash;
+  dict->slot[i].rle = rle;
+  dict->count++;
+}
 
-  // How many runs?
-  uint32 num_runs = 1;
-  for (uint32 i = 1; i < image_width; i++) {
-    if (RAW_row[i] != RAW_row[i - 1]) {
-      num_runs++;
+/// Intern the row just stored in the arena of image img.
+/// If img already stores an equal row, the new one is given back to the
+/// arena and the old one is returned; otherwise, the new row is returned
+/// (and remembered).
+static const RowHeader* InternRLERow(Image img, const RowHeader* RLE_row) {
+  size_t size = GetSizeRLERow(RLE_row);
+  uint64 hash = HashBytes(RLE_row, size);
+
+  RowDict* dict = img->dict;
+  if (dict == NULL) {
+    dict = img->dict = AllocateRowDict(64);
+  }
+  uint32 i = (uint32)hash & (dict->capacity - 1);
+  while (dict->slot[i].rle != NULL) {
+    if (dict->slot[i].hash == hash &&
+        memcmp(dict->slot[i].rle, RLE_row, size) == 0) {
+      // Found: RLE_row was the last row allocated from the fill block
+      Arena* block = img->fill;
+      assert((const uint8*)RLE_row >= block->data &&
+             (const uint8*)RLE_row < block->data + block->used);
+      block->used = (size_t)((const uint8*)RLE_row - block->data);
+      return dict->slot[i].rle;
     }
+    i = (i + 1) & (dict->capacity - 1);
   }
 
-  return num_runs;
+  // Not found: keep the table at most half full
+  if (2 * (dict->count + 1) > dict->capacity) {
+    RowDict* bigger = AllocateRowDict(2 * dict->capacity);
+    for (uint32 j = 0; j < dict->capacity; j++) {
+      if (dict->slot[j].rle != NULL) {
+        RowDictInsert(bigger, dict->slot[j].hash, dict->slot[j].rle);
+      }
+    }
+    free(dict);
+    dict = img->dict = bigger;
+  }
+  RowDictInsert(dict, hash, RLE_row);
+  return RLE_row;
 }
 
 /// Get the number of runs of a compressed RLE image row
-static uint32 GetNumRunsInRLERow(const int* RLE_row) {
+static uint32 GetNumRunsInRLERow(const RowHeader* RLE_row) {
   assert(RLE_row != NULL);
 
-  // Go through the RLE_row until EOR is found
-  // Discard RLE_row[0], since it is a pixel color
+  // Stored in the row header
+  return RLE_row->num_runs;
+}
 
-  uint32 num_runs = 0;
-  uint32 i = 1;
-  while (RLE_row[i] != EOR) {
-    num_runs++;
-    i++;
+/// Number of bytes of the LEB128 encoding of a run
+static inline uint32 VarintSize(uint32 run) {
+  uint32 n = 1;
+  while (run >= 0x80) {
+    run >>= 7;
+    n++;
   }
+  return n;
+}
 
-  return num_runs;
+/// Number of bytes of a bitmap row of the given width
+/// (a whole number of 64-bit words)
+static inline uint32 BitmapSize(uint32 width) {
+  return (width + 63) / 64 * 8;
 }
 
-/// Get the number of elements of an array storing a compressed RLE image row
-static uint32 GetSizeRLERowArray(const int* RLE_row) {
-  assert(RLE_row != NULL);
+/// Value of bit x of a bitmap (PBM order: top bit of each byte first)
+static inline uint8 GetBit(const uint8* bits, uint32 x) {
+  return (bits[x >> 3] >> (7 - (x & 7))) & 1;
+}
 
-  // Go through the array until EOR is found
-  uint32 i = 0;
-  while (RLE_row[i] != EOR) {
+/// Set n bits of a bitmap, starting at bit x
+static void SetBits(uint8* bits, uint32 x, uint32 n) {
+  if (n == 0) return;
+  uint32 end = x + n;
+  uint32 first = x >> 3;
+  uint32 last = (end - 1) >> 3;
+  uint8 head = 0xFF >> (x & 7);                // bits x.. of the first byte
+  uint8 tail = 0xFF << (7 - ((end - 1) & 7));  // bits ..end-1 of the last byte
+  if (first == last) {
+    bits[first] |= head & tail;
+  } else {
+    bits[first] |= head;
+    memset(bits + first + 1, 0xFF, last - first - 1);
+    bits[last] |= tail;
+  }
+}
+
+/// Load 8 bytes of a bitmap as a 64-bit word (the first pixel on top)
+static inline uint64 LoadBits64(const uint8* p) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64 word;
+  memcpy(&word, p, 8);
+  return __builtin_bswap64(word);
+#else
+  uint64 word = 0;
+  for (int i = 0; i < 8; i++) word = (word << 8) | p[i];
+  return word;
+#endif
+}
+
+/// Number of leading 0 bits of a nonzero word
+static inline uint32 Clz64(uint64 word) {
+  assert(word != 0);
+#if defined(__GNUC__)
+  return (uint32)__builtin_clzll(word);
+#else
+  uint32 n = 0;
+  while (!(word & ((uint64)1 << 63))) {
+    word <<= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+/// Position of the first bit of a bitmap, from bit x on, different from cur
+/// (or width, if there is none before width).
+/// The bitmap must have BitmapSize(width) bytes: it is read a 64-bit word
+/// at a time, so words all equal to cur (e.g., blank stretches of a page)
+/// are skipped at once, and the boundary is found with a single clz.
+static uint32 ScanBits(const uint8* bits, uint32 x, uint32 width, uint8 cur) {
+  if (x >= width) return width;
+  uint64 flip = cur ? ~(uint64)0 : 0;  // (so that we look for a 1)
+
+  uint32 i = x >> 6;  // the word of bit x
+  uint64 word = (LoadBits64(bits + 8 * i) ^ flip) & (~(uint64)0 >> (x & 63));
+  while (word == 0) {
     i++;
+    if (64 * i >= width) return width;
+    word = LoadBits64(bits + 8 * i) ^ flip;
+  }
+
+  x = 64 * i + Clz64(word);
+  return x < width ? x : width;
+}
+
+/// Sequential reader of the runs of a compressed RLE row.
+/// The runs are decoded on the fly, from whichever encoding the row uses.
+typedef struct {
+  const uint8* next;  // encoding of the next run
+  uint8 enc;          // the encoding of the row
+  uint8 bit;          // (BITMAP) bit value of the next run
+  uint32 pos;         // (BITMAP) position of the next run
+  uint32 width;       // (BITMAP) width of the row
+} RunReader;
+
+static inline RunReader ReadRuns(const RowHeader* RLE_row, uint32 width) {
+  RunReader reader = {(const uint8*)(RLE_row + 1), RLE_row->enc, 0, 0, width};
+  return reader;
+}
+
+/// Decode the next run.
+/// (The caller must not read more than num_runs runs.)
+static inline uint32 NextRun(RunReader* reader) {
+  const uint8* p = reader->next;
+  uint32 run;
+  if (reader->enc == RUN8) {
+    run = p[0];
+    reader->next = p + 1;
+  } else if (reader->enc == RUN16) {
+    uint16 r16;
+    memcpy(&r16, p, sizeof(r16));
+    run = r16;
+    reader->next = p + 2;
+  } else if (reader->enc == RUNVAR) {
+    uint8 byte;
+    int shift = 0;
+    run = 0;
+    do {
+      byte = *p++;
+      run |= (uint32)(byte & 0x7F) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    reader->next = p;
+  } else if (reader->enc == RUN32) {
+    memcpy(&run, p, sizeof(run));
+    reader->next = p + 4;
+  } else {
+    uint32 end = ScanBits(p, reader->pos, reader->width, reader->bit);
+    run = end - reader->pos;
+    reader->pos = end;
+    reader->bit ^= 1;
   }
+  return run;
+}
+
+/// Allocate a buffer for the runs of a row of the given width,
+/// used to assemble rows before storing them.
+/// (The caller is responsible for freeing the buffer!)
+static uint32* AllocateRunsBuffer(uint32 width) {
+  uint32* runs = malloc(width * sizeof(uint32));
+  check(runs != NULL, "malloc");
+  return runs;
+}
 
-  return (i + 1);
+/// A scratch row: runs assembled in a buffer, in the RUN32 encoding, so
+/// that they may be read like the rows of an image
+typedef struct {
+  RowHeader header;
+  uint32 runs[];
+} ScratchRow;
+
+/// Allocate a scratch row with room for the runs of a row of the given width.
+/// (The caller is responsible for freeing the row!)
+static ScratchRow* AllocateScratchRow(uint32 width) {
+  ScratchRow* row = malloc(sizeof(ScratchRow) + width * sizeof(uint32));
+  check(row != NULL, "malloc");
+  memset(&row->header, 0, sizeof(row->header));
+  row->header.enc = RUN32;
+  return row;
 }
 
-/// Compress into RLE format a RAW image row
-/// Allocates and returns the array storing the image row in RLE format
-static int* CompressRow(uint32 image_width, const uint8* RAW_row) {
-  assert(image_width > 0);
-  assert(RAW_row != NULL);
+/// The scratch row with its first n runs, starting with color
+static inline RowRef ScratchRef(ScratchRow* row, uint32 n, uint8 color) {
+  row->header.num_runs = n;
+  row->header.size = n * sizeof(uint32);
+  RowRef ref = {&row->header, color};
+  return ref;
+}
 
-  // How many runs?
-  uint32 num_runs = GetNumRunsInRAWRow(image_width, RAW_row);
+/// Choose the most compact encoding for the given runs
+/// (a bitmap, if that takes less memory than the runs).
+/// Returns the number of bytes needed to store them and sets (*enc).
+/// The choice depends only on the multiset of runs, so equal rows
+/// (and mirrored rows) are always encoded in the same way.
+static uint32 ChooseRunEncoding(const uint32* runs, uint32 num_runs,
+                                uint8* enc) {
+  uint32 max_run = 0;
+  uint32 var_size = 0;
+  uint32 width = 0;
+  for (uint32 i = 0; i < num_runs; i++) {
+    if (runs[i] > max_run) max_run = runs[i];
+    var_size += VarintSize(runs[i]);
+    width += runs[i];
+  }
 
-  // Allocate the RLE row array
-  int* RLE_row = malloc((num_runs + 2) * sizeof(int));
-  check(RLE_row != NULL, "malloc");
+  uint32 size;
+  if (max_run <= UINT8_MAX) {
+    *enc = RUN8;
+    size = num_runs;
+  } else if (max_run <= UINT16_MAX && 2 * num_runs <= var_size) {
+    *enc = RUN16;
+    size = 2 * num_runs;
+  } else {
+    *enc = RUNVAR;
+    size = var_size;
+  }
+  if (BitmapSize(width) < size) {
+    *enc = BITMAP;
+    size = BitmapSize(width);
+  }
+  return size;
+}
 
-  // Go through the RAW_row
-  RLE_row[0] = (int)RAW_row[0];  // Initial pixel value
-  uint32 index = 1;
-  int num_pixels = 1;
-  for (uint32 i = 1; i < image_width; i++) {
-    if (RAW_row[i] != RAW_row[i - 1]) {
-      RLE_row[index++] = num_pixels;
-      num_pixels = 0;
+/// Store the runs of a RLE row in the arena of image img,
+/// using the most compact encoding.
+/// Returns the stored row (which, if the image is interning rows,
+/// may be an equal row stored before).
+static const RowHeader* StoreRLERow(Image img, const uint32* runs,
+                                    uint32 num_runs) {
+  assert(num_runs > 0);
+  uint8 enc;
+  uint32 size = ChooseRunEncoding(runs, num_runs, &enc);
+
+  RowHeader* RLE_row = AllocateRLERow(img, size);
+  RLE_row->num_runs = num_runs;
+  RLE_row->enc = enc;
+
+  uint8* p = (uint8*)(RLE_row + 1);
+  if (enc == RUN8) {
+    for (uint32 i = 0; i < num_runs; i++) p[i] = (uint8)runs[i];
+  } else if (enc == RUN16) {
+    for (uint32 i = 0; i < num_runs; i++) {
+      uint16 r16 = (uint16)runs[i];
+      memcpy(p + 2 * i, &r16, sizeof(r16));
+    }
+  } else if (enc == RUNVAR) {
+    for (uint32 i = 0; i < num_runs; i++) {
+      uint32 run = runs[i];
+      while (run >= 0x80) {
+        *p++ = (uint8)(run | 0x80);
+        run >>= 7;
+      }
+      *p++ = (uint8)run;
+    }
+  } else {
+    // The odd runs differ from the first pixel
+    memset(p, 0, size);
+    uint32 x = 0;
+    for (uint32 i = 0; i < num_runs; i++) {
+      if (i & 1) SetBits(p, x, runs[i]);
+      x += runs[i];
     }
-    num_pixels++;
   }
-  RLE_row[index++] = num_pixels;
-  RLE_row[index] = EOR;  // Reached the end of the row
 
+  if (intern_rows) return InternRLERow(img, RLE_row);
   return RLE_row;
 }
 
-static uint8* UncompressRow(uint32 image_width, const int* RLE_row) {
-  assert(image_width > 0);
-  assert(RLE_row != NULL);
+// Bitmap rows
+
+/// Number of 1 bits of a word
+static inline uint32 PopCount64(uint64 word) {
+#if defined(__GNUC__)
+  return (uint32)__builtin_popcountll(word);
+#else
+  uint32 n = 0;
+  for (; word != 0; word &= word - 1) n++;
+  return n;
+#endif
+}
 
-  // The uncompressed row
-  uint8* row = (uint8*)malloc(image_width * sizeof(uint8));
-  check(row != NULL, "malloc");
+/// Number of runs of a BITMAP row of the given width
+static uint32 CountBitmapRuns(const uint8* bits, uint32 width) {
+  assert(GetBit(bits, 0) == 0);
+  uint32 size = BitmapSize(width);
+
+  // Count the pixels that differ from the previous one, a word at a time
+  uint32 changes = 0;
+  uint64 prev = 0;  // the last bit of the previous word
+  for (uint32 i = 0; i < size; i += 8) {
+    uint64 word = LoadBits64(bits + i);
+    changes += PopCount64(word ^ ((word >> 1) | (prev << 63)));
+    prev = word & 1;
+  }
+  // (The zero padding, if any, starts with a change if the last pixel is 1)
+  if (width < 8 * size && GetBit(bits, width - 1)) changes--;
 
-  // Go through the RLE_row until EOR is found
-  int pixel_value = RLE_row[0];
-  uint32 i = 1;
-  uint32 dest_i = 0;
-  while (RLE_row[i] != EOR) {
-    // For each run
-    for (int aux = 0; aux < RLE_row[i]; aux++) {
-      row[dest_i++] = (uint8)pixel_value;
-    }
-    // Next run
-    i++;
-    pixel_value ^= 1;
+  return changes + 1;
+}
+
+/// Store a row, given by its pixels as a bitmap, in the arena of image img.
+///   bits : the bitmap, with BitmapSize(width) bytes (which may be modified;
+///          the bits after width are ignored)
+///   runs : a buffer for width runs
+/// The row is stored in the encoding StoreRLERow would choose for its runs,
+/// so it is a BITMAP row only if that is more compact than the runs.
+static RowRef StoreBitmapRow(Image img, uint8* bits, uint32 width,
+                             uint32* runs) {
+  assert(width > 0);
+  uint32 size = BitmapSize(width);
+
+  RowRef row;
+  row.color = GetBit(bits, 0);
+
+  // Find the runs, in a single pass over the words of the bitmap.
+  // Once there are more than size runs, the bitmap is more compact
+  // (as the runs take at least a byte each) and the pass stops.
+  uint32 num_runs = 0;
+  uint32 x = 0;
+  uint8 bit = row.color;
+  while (x < width && num_runs <= size) {
+    uint32 end = ScanBits(bits, x, width, bit);
+    runs[num_runs++] = end - x;
+    x = end;
+    bit ^= 1;
+  }
+  if (num_runs <= size) {
+    row.rle = StoreRLERow(img, runs, num_runs);
+    return row;
   }
 
+  // Make the bits relative to the first pixel, with zero padding
+  if (row.color) {
+    for (uint32 i = 0; i < size; i++) bits[i] ^= 0xFF;
+  }
+  uint32 last = (width - 1) >> 3;  // last byte with pixels
+  bits[last] &= 0xFF << (7 - ((width - 1) & 7));
+  memset(bits + last + 1, 0, size - last - 1);
+
+  RowHeader* RLE_row = AllocateRLERow(img, size);
+  RLE_row->num_runs = CountBitmapRuns(bits, width);
+  RLE_row->enc = BITMAP;
+  memcpy(RLE_row + 1, bits, size);
+  row.rle = intern_rows ? InternRLERow(img, RLE_row) : RLE_row;
   return row;
 }
 
+/// Write the pixels of a row of the given width to a bitmap
+/// of BitmapSize(width) bytes
+static void ExpandRow(RowRef row, uint32 width, uint8* bits) {
+  uint32 size = BitmapSize(width);
+  if (row.rle->enc == BITMAP) {
+    memcpy(bits, row.rle + 1, size);
+    if (row.color) {
+      for (uint32 i = 0; i < size; i++) bits[i] ^= 0xFF;
+    }
+    return;
+  }
+
+  memset(bits, 0, size);
+  RunReader reader = ReadRuns(row.rle, width);
+  uint8 pixel_value = row.color;
+  uint32 x = 0;
+  for (uint32 i = 0; i < row.rle->num_runs; i++) {
+    uint32 run = NextRun(&reader);
+    if (pixel_value) SetBits(bits, x, run);
+    x += run;
+    pixel_value ^= 1;
+  }
+}
+
 // Add your auxiliary functions here...
 
+/// Parallel execution
+
+// Operations that process the rows of an image independently split them
+// among a pool of threads (see ImageSetThreads); the calling thread works
+// as worker 0.
+// The rows are cut into chunks of about the same cost (e.g., the number
+// of runs to process), several per thread, which the threads take in turn:
+// rows of very different costs are still balanced among the threads.
+//
+// Arena blocks are not shared by the threads: each worker stores new rows
+// in its own row store (see BeginRowStores), handed over to the image
+// when the operation ends.
+
+// Process rows first..last-1 (ctx is the state of the operation)
+typedef void (*RowJob)(void* ctx, uint32 worker, uint32 first, uint32 last);
+// Relative cost of processing a row
+typedef uint32 (*RowCost)(void* ctx, uint32 row);
+
+// Minimum number of rows of a parallel operation
+#define PARALLEL_MIN_ROWS 16
+// Number of chunks per thread
+#define CHUNKS_PER_THREAD 8
+
+typedef struct {
+  RowJob run;
+  void* ctx;
+  const uint32* bound;  // chunk c has rows bound[c]..bound[c+1]-1
+  uint32 num_chunks;
+  atomic_uint next;     // next chunk to take
+} ParallelJob;
+
+// The thread pool
+static struct {
+  uint32 num_workers;  // threads started (besides the caller)
+  pthread_t* thread;
+  pthread_mutex_t lock;
+  pthread_cond_t start;  // a new job was posted
+  pthread_cond_t done;   // all workers finished the job
+  ParallelJob* job;      // the current job
+  uint32 generation;     // number of jobs posted
+  uint32 busy;           // workers still on the current job
+  int quit;
+} pool = {0, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+          PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0};
+
+/// Take and process chunks of job until none is left
+static void RunChunks(ParallelJob* job, uint32 worker) {
+  uint32 c;
+  while ((c = atomic_fetch_add(&job->next, 1)) < job->num_chunks) {
+    job->run(job->ctx, worker, job->bound[c], job->bound[c + 1]);
+  }
+}
+
+static void* PoolWorker(void* arg) {
+  uint32 worker = (uint32)(uintptr_t)arg;
+  uint32 seen = 0;  // generation of the last job seen
+
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (pool.generation == seen && !pool.quit) {
+      pthread_cond_wait(&pool.start, &pool.lock);
+    }
+    if (pool.quit) break;
+    seen = pool.generation;
+    ParallelJob* job = pool.job;
+    pthread_mutex_unlock(&pool.lock);
+
+    RunChunks(job, worker);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.busy == 0) pthread_cond_signal(&pool.done);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+/// Stop the threads of the pool (if any)
+static void StopPool(void) {
+  if (pool.num_workers == 0) return;
+
+  pthread_mutex_lock(&pool.lock);
+  pool.quit = 1;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.lock);
+  for (uint32 i = 0; i < pool.num_workers; i++) {
+    pthread_join(pool.thread[i], NULL);
+  }
+
+  free(pool.thread);
+  pool.thread = NULL;
+  pool.num_workers = 0;
+  pool.generation = 0;
+  pool.quit = 0;
+}
+
+/// Start num_workers threads in the pool
+static void StartPool(uint32 num_workers) {
+  assert(pool.num_workers == 0 && pool.generation == 0);
+  pool.thread = malloc(num_workers * sizeof(pthread_t));
+  check(pool.thread != NULL, "malloc");
+  for (uint32 i = 0; i < num_workers; i++) {
+    errno = pthread_create(&pool.thread[i], NULL, PoolWorker,
+                           (void*)(uintptr_t)(i + 1));
+    check(errno == 0, "pthread_create");
+    pool.num_workers++;
+  }
+}
+
+/// Number of threads for an operation on height rows
+static uint32 ThreadsFor(uint32 height) {
+  // (The row dictionary of an image is not shared by threads)
+  if (num_threads <= 1 || intern_rows || height < PARALLEL_MIN_ROWS) return 1;
+  return num_threads;
+}
+
+/// Process rows 0..height-1 with threads threads (see ThreadsFor),
+/// calling run(ctx, worker, first, last) for chunks of rows.
+/// If cost is not NULL, chunks have about the same total cost(ctx, row),
+/// otherwise the same number of rows.
+static void ParallelRows(uint32 threads, uint32 height, RowJob run,
+                         RowCost cost, void* ctx) {
+  if (threads <= 1 || height == 0) {
+    if (height > 0) run(ctx, 0, 0, height);
+    return;
+  }
+  if (pool.num_workers != threads - 1) {
+    StopPool();
+    StartPool(threads - 1);
+  }
+
+  // Cut the rows into chunks
+  uint32 num_chunks = threads * CHUNKS_PER_THREAD;
+  if (num_chunks > height) num_chunks = height;
+  uint32* bound = malloc((num_chunks + 1) * sizeof(uint32));
+  check(bound != NULL, "malloc");
+  bound[0] = 0;
+  if (cost == NULL) {
+    for (uint32 c = 1; c < num_chunks; c++) {
+      bound[c] = (uint32)((uint64)height * c / num_chunks);
+    }
+  } else {
+    // (Every row costs at least 1)
+    uint64 total = 0;
+    for (uint32 h = 0; h < height; h++) total += (uint64)cost(ctx, h) + 1;
+    uint64 acc = 0;
+    uint32 c = 1;
+    for (uint32 h = 0; h < height && c < num_chunks; h++) {
+      acc += (uint64)cost(ctx, h) + 1;
+      while (c < num_chunks && acc * num_chunks >= total * c) {
+        bound[c++] = h + 1;
+      }
+    }
+  }
+  bound[num_chunks] = height;
+
+  ParallelJob job = {run, ctx, bound, num_chunks, 0};
+
+  pthread_mutex_lock(&pool.lock);
+  pool.job = &job;
+  pool.busy = pool.num_workers;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.lock);
+
+  RunChunks(&job, 0);
+
+  pthread_mutex_lock(&pool.lock);
+  while (pool.busy > 0) {
+    pthread_cond_wait(&pool.done, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  free(bound);
+}
+
+/// Allocate a row store: an image header with no row table, only an arena,
+/// able to hold (at least) capacity bytes of RLE rows
+static Image AllocateRowStore(uint32 width, size_t capacity) {
+  Image store = malloc(sizeof(struct image));
+  check(store != NULL, "malloc");
+
+  store->width = width;
+  store->height = 0;
+  store->row = NULL;
+  store->arena = NULL;
+  store->num_arenas = 0;
+  store->max_arenas = 0;
+  store->fill = NULL;
+  store->spare = NULL;
+  store->garbage = 0;
+  store->dict = NULL;
+  store->row_hash = NULL;
+  store->row_black = NULL;
+  store->index = NULL;
+  store->uses = NULL;
+  if (capacity > 0) {
+    store->fill = AllocateArenaBlock(capacity);
+    AddArenaBlock(store, store->fill);
+  }
+
+  return store;
+}
+
+/// The row stores of the threads of an operation storing new rows in
+/// image dst: worker 0 stores them in dst itself, the others in a row
+/// store each, with room for capacity bytes.
+static Image* BeginRowStores(Image dst, uint32 threads, size_t capacity) {
+  Image* store = malloc(threads * sizeof(Image));
+  check(store != NULL, "malloc");
+
+  store[0] = dst;
+  for (uint32 w = 1; w < threads; w++) {
+    store[w] = AllocateRowStore(dst->width, capacity);
+  }
+
+  return store;
+}
+
+/// Hand over the rows stored by the threads of an operation to image dst.
+static void EndRowStores(Image dst, Image* store, uint32 threads) {
+  for (uint32 w = 1; w < threads; w++) {
+    for (uint32 i = 0; i < store[w]->num_arenas; i++) {
+      Arena* block = store[w]->arena[i];
+      if (block->used > 0) {
+        AddArenaBlock(dst, block);
+        block->refcount--;
+      } else {
+        free(block);
+      }
+    }
+    free(store[w]->arena);
+    free(store[w]);
+  }
+  free(store);
+}
+
+
 /// Image management functions
 
 /// Create a new BW image, either BLACK or WHITE.
@@ -236,19 +1177,26 @@ Image ImageCreate(uint32 width, uint32 height, uint8 val) {
   assert(width > 0 && height > 0);
   assert(val == WHITE || val == BLACK);
 
-  Image newImage = AllocateImageHeader(width, height);
+  // (A single run takes at most 5 bytes)
+  Image newImage = AllocateImageHeader(width, height, sizeof(RowHeader) + 8);
 
   // All image pixels have the same value
-  int pixel_value = (int)val;
+  uint8 pixel_value = val;
 
   // Creating the image rows, each row has just 1 run of pixels
-  // Each row is represented by an array of 3 elements [value,length,EOR]
+  // All rows are equal: the row is stored once and shared by all
+  uint32 run = width;
+  newImage->row[0].rle = StoreRLERow(newImage, &run, 1);
+  newImage->row[0].color = pixel_value;
+  for (uint32 i = 1; i < height; i++) {
+    newImage->row[i] = newImage->row[0];
+  }
+
+  uint32* row_black = NewCounts(height);
   for (uint32 i = 0; i < height; i++) {
-    newImage->row[i] = AllocateRLERowArray(3);
-    newImage->row[i][0] = pixel_value;
-    newImage->row[i][1] = (int)width;
-    newImage->row[i][2] = EOR;
+    row_black[i] = pixel_value == BLACK ? width : 0;
   }
+  SetCounts(newImage, row_black);
 
   return newImage;
 }
@@ -274,36 +1222,60 @@ Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
   check(height%square_edge == 0, "O comprimento da imagem tem de ser múltipla do lado do quadrado!\n");
   check(first_value == BLACK || first_value == WHITE, "first_valua tem de ser BLACK ou WHITE!\n");
 
-  Image newImage = AllocateImageHeader(width, height);
-
-  uint32 bitColor = first_value == BLACK ? 0:1; // aqui estamos a fazer invertido devido à verificação que
-                                                //se segue no for loop h%3==0 (que alterna logo na primeira iteração)
-
   // criação da primeira linha xadrez (as próximas serão iguais apenas alternando o primeiro bit (bitColor)
-  int n = width / square_edge + 2;
-  int *first_row = malloc(n * sizeof(int));
-
-  *(first_row) = bitColor;
-  *(first_row + n - 1) = -1;
-  for (int w=1; w<n-1; w++) {
-    *(first_row + w) = square_edge;
+  uint32 n = width / square_edge;  // número de runs
+  uint32* first_row = AllocateRunsBuffer(n);
+  for (uint32 w=0; w<n; w++) {
+    first_row[w] = square_edge;
   }
 
+  // Todas as linhas têm as mesmas runs (só muda a cor do primeiro pixel):
+  // a linha é guardada uma só vez e partilhada por todas
+  uint8 enc;
+  size_t row_size = sizeof(RowHeader) + ChooseRunEncoding(first_row, n, &enc);
+  Image newImage = AllocateImageHeader(width, height, row_size + ROW_ALIGN);
+  const RowHeader* chess_row = StoreRLERow(newImage, first_row, n);
+
+  uint8 bitColor = first_value == BLACK ? 0:1; // aqui estamos a fazer invertido devido à verificação que
+                                               //se segue no for loop h%3==0 (que alterna logo na primeira iteração)
+
   for(uint32 h=0; h<height; h++) {
+    newImage->row[h].rle = chess_row;
+
     if (h%square_edge == 0) { // alternamos a cor
       bitColor = bitColor == 0 ? 1:0;
-      first_row[0] = bitColor;
     }
-    
-    newImage->row[h] = AllocateRLERowArray(n);
-    memcpy(newImage->row[h], first_row, n * sizeof(int));
-
+    newImage->row[h].color = bitColor;
   }
   free(first_row);
 
   return newImage;
 }
 
+/// Create a copy of an image.
+/// The copy shares the compressed rows of img, which are never modified,
+/// so this takes time proportional to the height of the image only.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageClone(const Image img) {
+  assert(img != NULL);
+
+  Image newImage = AllocateImageHeader(img->width, img->height, 0);
+  ShareArena(newImage, img);
+  memcpy(newImage->row, img->row, img->height * sizeof(RowRef));
+
+  // (The hashes of the rows are still valid, if computed)
+  if (img->row_hash != NULL) {
+    newImage->row_hash = malloc(img->height * sizeof(uint64));
+    check(newImage->row_hash != NULL, "malloc");
+    memcpy(newImage->row_hash, img->row_hash, img->height * sizeof(uint64));
+    newImage->hash = img->hash;
+  }
+  SetCounts(newImage, CopyCounts(img));
+
+  return newImage;
+}
 
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
@@ -314,10 +1286,21 @@ void ImageDestroy(Image* imgp) {
   assert(imgp != NULL);
 
   Image img = *imgp;
-
-  for (uint32 i = 0; i < img->height; i++) {
-    free(img->row[i]);
+  if (img == NULL) return;
+
+  // The rows live in the arena: just release its blocks
+  // (those still referenced by other images are kept)
+  for (uint32 i = 0; i < img->num_arenas; i++) {
+    Arena* block = img->arena[i];
+    assert(block->refcount > 0);
+    if (--block->refcount == 0) {
+      free(block);
+    }
   }
+  free(img->spare);
+  free(img->arena);
+  free(img->dict);
+  ForgetRowCaches(img);
   free(img->row);
   free(img);
 
@@ -336,10 +1319,13 @@ void ImageRAWPrint(const Image img) {
   // Print the pixels of each image row
   for (uint32 i = 0; i < img->height; i++) {
     // The value of the first pixel in the current row
-    int pixel_value = img->row[i][0];
-    for (uint32 j = 1; img->row[i][j] != EOR; j++) {
+    int pixel_value = img->row[i].color;
+    uint32 num_runs = GetNumRunsInRLERow(img->row[i].rle);
+    RunReader reader = ReadRuns(img->row[i].rle, img->width);
+    for (uint32 j = 0; j < num_runs; j++) {
       // Print the current run of pixels
-      for (int k = 0; k < img->row[i][j]; k++) {
+      uint32 run = NextRun(&reader);
+      for (uint32 k = 0; k < run; k++) {
         printf("%d", pixel_value);
       }
       // Switch (XOR) to the pixel value for the next run, if any
@@ -359,12 +1345,15 @@ void ImageRLEPrint(const Image img) {
   printf("RLE encoding:\n");
 
   // Print the compressed rows information
+  // (first pixel value and runs, terminated by EOR)
   for (uint32 i = 0; i < img->height; i++) {
-    uint32 j;
-    for (j = 0; img->row[i][j] != EOR; j++) {
-      printf("%d ", img->row[i][j]);
+    uint32 num_runs = GetNumRunsInRLERow(img->row[i].rle);
+    RunReader reader = ReadRuns(img->row[i].rle, img->width);
+    printf("%d ", img->row[i].color);
+    for (uint32 j = 0; j < num_runs; j++) {
+      printf("%u ", NextRun(&reader));
     }
-    printf("%d\n", img->row[i][j]);
+    printf("%d\n", EOR);
   }
   printf("\n");
 }
@@ -374,34 +1363,6 @@ void ImageRLEPrint(const Image img) {
 // See PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
 
 // Auxiliary function
-static void unpackBits(int nbytes, const uint8 bytes[], uint8 raw_row[]) {
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8) {  // or (mask > 0)
-    for (int b = 0; b < nbytes; b++) {
-      raw_row[8 * b + offset] = (bytes[b] & mask) != 0;
-    }
-    mask >>= 1;
-    offset++;
-  }
-}
-
-// Auxiliary function
-static void packBits(int nbytes, uint8 bytes[], const uint8 raw_row[]) {
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8) {  // or (mask > 0)
-    for (int b = 0; b < nbytes; b++) {
-      if (offset == 0) bytes[b] = 0;
-      bytes[b] |= raw_row[8 * b + offset] ? mask : 0;
-    }
-    mask >>= 1;
-    offset++;
-  }
-}
-
 // Match and skip 0 or more comment lines in file f.
 // Comments start with a # and continue until the end-of-line, inclusive.
 // Returns the number of comments skipped.
@@ -414,86 +1375,736 @@ static int skipComments(FILE* f) {
   return i;
 }
 
-/// Load a raw PBM file.
-/// Only binary PBM files are accepted.
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageLoad(const char* filename) {  ///
-  int w, h;
+/// Parse the header of a PBM file, leaving f at the first pixel.
+static void ReadPBMHeader(FILE* f, int* w, int* h) {
   char c;
-  FILE* f = NULL;
-  Image img = NULL;
-
-  check((f = fopen(filename, "rb")) != NULL, "Open failed");
-  // Parse PBM header
   check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
   skipComments(f);
-  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
+  check(fscanf(f, "%d ", w) == 1 && *w >= 0, "Invalid width");
   skipComments(f);
-  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
+  check(fscanf(f, "%d", h) == 1 && *h >= 0, "Invalid height");
   check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+}
 
-  // Allocate image
-  img = AllocateImageHeader(w, h);
+// Size of the batches of rows read or written at once
+#define IO_BATCH_BYTES (1 << 20)
 
-  // Read pixels
-  int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  uint8 raw_row[nbytes * 8];
-  for (uint32 i = 0; i < img->height; i++) {
-    check(fread(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
-          "Reading pixels");
-    unpackBits(nbytes, bytes, raw_row);
-    img->row[i] = CompressRow(w, raw_row);
+/// Number of rows of nbytes bytes in a batch (of an image with height rows)
+static uint32 BatchRows(int nbytes, uint32 height) {
+  uint32 batch = IO_BATCH_BYTES / nbytes;
+  if (batch == 0) batch = 1;
+  if (batch > height) batch = height;
+  return batch;
+}
+
+// Minimum size of the pixels of a PBM file for it to be mapped into memory
+// (below that, reading it is as fast)
+#ifndef MMAP_MIN_BYTES
+#define MMAP_MIN_BYTES (1 << 24)
+#endif
+
+/// Map into memory the nbytes of pixels of an open PBM file,
+/// which start at its current position.
+/// Returns a pointer to the pixels, and the mapping in map and map_size,
+/// or NULL if the file is too small to be worth mapping, or cannot be mapped
+/// (e.g., it is a pipe); then the pixels must be read.
+static const uint8* MapPixels(FILE* f, size_t nbytes, void** map,
+                              size_t* map_size) {
+  if (nbytes < MMAP_MIN_BYTES) return NULL;
+  long offset = ftell(f);
+  struct stat st;
+  if (offset < 0 || fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return NULL;
   }
+  check((size_t)st.st_size >= (size_t)offset + nbytes, "Reading pixels");
+
+  // (A mapping must start at a page boundary, so the header is mapped too)
+  *map_size = (size_t)offset + nbytes;
+  *map = mmap(NULL, *map_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  if (*map == MAP_FAILED) return NULL;
+  madvise(*map, *map_size, MADV_SEQUENTIAL);
+  return (const uint8*)*map + offset;
+}
 
-  fclose(f);
-  return img;
+/// Is f a regular file (so its pixels may be read at any position)?
+static int IsRegularFile(FILE* f) {
+  struct stat st;
+  return fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode);
 }
 
-/// Save image to PBM file.
-/// On success, returns unspecified integer. (No need to check!)
-/// On failure, does not return, EXITS program!
-int ImageSave(const Image img, const char* filename) {  ///
-  assert(img != NULL);
-  int w = img->width;
-  int h = img->height;
-  FILE* f = NULL;
+typedef struct {
+  Image* store;        // the row store of each worker
+  Image dst;
+  const uint8* bytes;  // the packed pixels of the batch (or NULL)
+  uint32 first_row;    // the first row of the batch
+  int nbytes;          // number of bytes for each row
+  int fd;              // if bytes is NULL: the file the workers read
+  off_t data_pos;      // and the position of its pixels
+} LoadJob;
+
+/// Compress rows first..last-1 of a batch into the store of a worker,
+/// given their packed pixels
+static void DecodeRows(LoadJob* job, Image store, const uint8* bytes,
+                       uint32 first, uint32 last) {
+  Image img = job->dst;
+  int nbytes = job->nbytes;
+
+  // The runs are found directly in the packed bytes of each row
+  // (copied to a bitmap padded to whole words)
+  uint32 size = BitmapSize(img->width);
+  uint8* bits = malloc(size);
+  check(bits != NULL, "malloc");
+  memset(bits + nbytes, 0, size - nbytes);
+  uint32* runs = AllocateRunsBuffer(img->width);
+  for (uint32 i = first; i < last; i++) {
+    memcpy(bits, bytes + (size_t)(i - first) * nbytes, nbytes);
+    img->row[job->first_row + i] =
+        StoreBitmapRow(store, bits, img->width, runs);
+  }
+  free(runs);
+  free(bits);
+}
 
-  check((f = fopen(filename, "wb")) != NULL, "Open failed");
-  check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
+static void CompressRows(void* ctx, uint32 worker, uint32 first,
+                         uint32 last) {
+  LoadJob* job = ctx;
+  Image store = job->store[worker];
+  int nbytes = job->nbytes;
 
-  // Write pixels
-  int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  // unit8 raw_row[nbytes*8];
-  for (uint32 i = 0; i < img->height; i++) {
-    // UncompressRow...
-    uint8* raw_row = UncompressRow(nbytes * 8, img->row[i]);
-    // Fill padding pixels with WHITE
-    memset(raw_row + w, WHITE, nbytes * 8 - w);
-    packBits(nbytes, bytes, raw_row);
-    size_t written = fwrite(bytes, sizeof(uint8), nbytes, f);
-    check(written == (size_t)nbytes, "Writing pixels failed");
-    free(raw_row);
+  if (job->bytes != NULL) {
+    DecodeRows(job, store, job->bytes + (size_t)first * nbytes, first, last);
+    return;
   }
 
-  // Cleanup
-  fclose(f);
-  return 0;
+  // Each worker reads its own rows from the file, a batch at a time
+  uint32 batch = BatchRows(nbytes, last - first);
+  uint8* bytes = malloc((size_t)batch * nbytes);
+  check(bytes != NULL, "malloc");
+  for (uint32 i = first; i < last; i += batch) {
+    uint32 n = last - i < batch ? last - i : batch;
+    size_t size = (size_t)n * nbytes;
+    off_t pos = job->data_pos + (off_t)(job->first_row + i) * nbytes;
+    for (size_t done = 0; done < size;) {
+      ssize_t r = pread(job->fd, bytes + done, size - done, pos + done);
+      check(r > 0, "Reading pixels");
+      done += r;
+    }
+    DecodeRows(job, store, bytes, i, i + n);
+  }
+  free(bytes);
 }
 
-/// Information queries
-
-/// Get image width
-int ImageWidth(const Image img) {
-  assert(img != NULL);
-  return img->width;
+typedef struct {
+  Image img;
+  uint8* bytes;      // the packed pixels of the batch (or NULL)
+  uint32 first_row;  // the first row of the batch
+  int nbytes;        // number of bytes for each row
+  int fd;            // if bytes is NULL: the file the workers write
+  off_t data_pos;    // and the position of its pixels
+} SaveJob;
+
+static uint32 PackCost(void* ctx, uint32 i) {
+  SaveJob* job = ctx;
+  return GetNumRunsInRLERow(job->img->row[job->first_row + i].rle);
 }
 
-/// Get image height
+/// Write a row as the (width + 7) / 8 packed bytes of a PBM row,
+/// with the padding bits set to 0.
+/// Each run fills whole bytes at once: only the bytes where a run
+/// starts or ends are masked.
+static void PackRow(RowRef row, uint32 width, uint8* bytes) {
+  uint32 nbytes = (width + 7) / 8;
+  if (nbytes == 0) return;
+
+  if (row.rle->enc == BITMAP) {
+    memcpy(bytes, row.rle + 1, nbytes);
+    if (row.color) {
+      for (uint32 i = 0; i < nbytes; i++) bytes[i] ^= 0xFF;
+      bytes[nbytes - 1] &= 0xFF << (8 * nbytes - width);
+    }
+    return;
+  }
+
+  RunReader reader = ReadRuns(row.rle, width);
+  uint8 fill = row.color ? 0xFF : 0x00;
+  uint32 x = 0;
+  for (uint32 i = 0; i < row.rle->num_runs; i++) {
+    uint32 end = x + NextRun(&reader);
+    uint32 b = x >> 3;
+    if (x & 7) {
+      // Finish the byte started by the previous run
+      // (its bits from x on are still 0)
+      uint8 mask = 0xFF >> (x & 7);
+      if (end >> 3 == b) mask &= ~(0xFF >> (end & 7));
+      bytes[b++] |= fill & mask;
+    }
+    uint32 e = end >> 3;  // the byte where the run ends
+    if (e > b) memset(bytes + b, fill, e - b);
+    if ((end & 7) && e >= b) bytes[e] = fill & ~(0xFF >> (end & 7));
+    x = end;
+    fill = ~fill;
+  }
+}
+
+static void PackRows(void* ctx, uint32 worker, uint32 first, uint32 last) {
+  (void)worker;
+  SaveJob* job = ctx;
+  Image img = job->img;
+  int nbytes = job->nbytes;
+
+  if (job->bytes != NULL) {
+    for (uint32 i = first; i < last; i++) {
+      PackRow(img->row[job->first_row + i], img->width,
+              job->bytes + (size_t)i * nbytes);
+    }
+    return;
+  }
+
+  // Each worker writes its own rows to the file, a batch at a time
+  uint32 batch = BatchRows(nbytes, last - first);
+  uint8* bytes = malloc((size_t)batch * nbytes);
+  check(bytes != NULL, "malloc");
+  for (uint32 i = first; i < last; i += batch) {
+    uint32 n = last - i < batch ? last - i : batch;
+    for (uint32 j = 0; j < n; j++) {
+      PackRow(img->row[job->first_row + i + j], img->width,
+              bytes + (size_t)j * nbytes);
+    }
+    size_t size = (size_t)n * nbytes;
+    off_t pos = job->data_pos + (off_t)(job->first_row + i) * nbytes;
+    for (size_t done = 0; done < size;) {
+      ssize_t r = pwrite(job->fd, bytes + done, size - done, pos + done);
+      check(r > 0, "Writing pixels failed");
+      done += r;
+    }
+  }
+  free(bytes);
+}
+
+/// Load a raw PBM file.
+/// Only binary PBM files are accepted.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoad(const char* filename) {  ///
+  int w, h;
+  FILE* f = NULL;
+  Image img = NULL;
+
+  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  ReadPBMHeader(f, &w, &h);
+
+  // Allocate image
+  // (The arena grows as needed. Start assuming a few runs per row.)
+  uint32 threads = ThreadsFor(h);
+  size_t capacity = (sizeof(RowHeader) + 8) * (size_t)h / threads;
+  img = AllocateImageHeader(w, h, capacity);
+
+  // Read pixels
+  // (compressed by the threads).
+  // As all rows have nbytes bytes, the position of each row in the file is
+  // known: each thread decodes its own block of rows, either straight from
+  // the mapped pages (of a large file) or reading them with pread.
+  // Only a file that cannot be read at any position (e.g., a pipe) is read
+  // in sequence, a batch of rows at a time.
+  int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
+  void* map = NULL;
+  size_t map_size = 0;
+  const uint8* pixels = MapPixels(f, (size_t)h * nbytes, &map, &map_size);
+  LoadJob job = {BeginRowStores(img, threads, capacity), img, pixels, 0,
+                 nbytes, -1, 0};
+  if (pixels == NULL && IsRegularFile(f)) {
+    job.fd = fileno(f);
+    job.data_pos = ftell(f);
+    check(job.data_pos >= 0, "Reading pixels");
+  }
+  if (pixels != NULL || job.fd >= 0) {
+    ParallelRows(threads, img->height, CompressRows, NULL, &job);
+  } else {
+    uint32 batch = BatchRows(nbytes, img->height);
+    uint8* bytes = malloc((size_t)batch * nbytes);
+    check(bytes != NULL, "malloc");
+    job.bytes = bytes;
+    for (uint32 i = 0; i < img->height; i += batch) {
+      uint32 n = img->height - i < batch ? img->height - i : batch;
+      check(fread(bytes, sizeof(uint8), (size_t)n * nbytes, f) ==
+                (size_t)n * nbytes,
+            "Reading pixels");
+      job.first_row = i;
+      ParallelRows(ThreadsFor(n), n, CompressRows, NULL, &job);
+    }
+    free(bytes);
+  }
+  EndRowStores(img, job.store, threads);
+  if (map != NULL) munmap(map, map_size);
+
+  fclose(f);
+  return img;
+}
+
+/// Save image to PBM file.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSave(const Image img, const char* filename) {  ///
+  assert(img != NULL);
+  int w = img->width;
+  int h = img->height;
+  FILE* f = NULL;
+
+  check((f = fopen(filename, "wb")) != NULL, "Open failed");
+  check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
+
+  // Write pixels
+  // (packed by the threads).
+  // As all rows have nbytes bytes, the position of each row in the file is
+  // known: each thread packs its own block of rows and writes it with
+  // pwrite. Only a file that cannot be written at any position (e.g., a
+  // pipe) is written in sequence, a batch of rows at a time.
+  int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
+  SaveJob job = {img, NULL, 0, nbytes, -1, 0};
+  if (IsRegularFile(f)) {
+    check(fflush(f) == 0, "Writing header failed");
+    job.fd = fileno(f);
+    job.data_pos = ftell(f);
+    check(job.data_pos >= 0, "Writing pixels failed");
+    ParallelRows(ThreadsFor(h), img->height, PackRows, PackCost, &job);
+  } else {
+    uint32 batch = BatchRows(nbytes, img->height);
+    uint8* bytes = malloc((size_t)batch * nbytes);
+    check(bytes != NULL, "malloc");
+    job.bytes = bytes;
+    for (uint32 i = 0; i < img->height; i += batch) {
+      uint32 n = img->height - i < batch ? img->height - i : batch;
+      job.first_row = i;
+      ParallelRows(ThreadsFor(n), n, PackRows, PackCost, &job);
+      size_t written = fwrite(bytes, sizeof(uint8), (size_t)n * nbytes, f);
+      check(written == (size_t)n * nbytes, "Writing pixels failed");
+    }
+    free(bytes);
+  }
+
+  // Cleanup
+  fclose(f);
+  return 0;
+}
+
+// Streaming PBM files
+
+struct imageReader {
+  FILE* f;
+  uint32 width, height;
+  uint32 num_read;  // number of rows read
+  int nbytes;       // number of bytes for each row
+  uint8* bits;      // a row, padded to BitmapSize(width) bytes
+  uint32* runs;     // the runs of a row
+};
+
+struct imageWriter {
+  FILE* f;
+  uint32 width, height;
+  uint32 num_written;  // number of rows written (or buffered)
+  int nbytes;          // number of bytes for each row
+  uint8* bytes;        // the buffered rows, packed
+  uint32 batch;        // capacity of bytes, in rows
+  uint32 num_buffered;
+};
+
+ImageReader ImageReaderOpen(const char* filename) {  ///
+  int w, h;
+  ImageReader r = malloc(sizeof(struct imageReader));
+  check(r != NULL, "malloc");
+
+  check((r->f = fopen(filename, "rb")) != NULL, "Open failed");
+  ReadPBMHeader(r->f, &w, &h);
+  r->width = w;
+  r->height = h;
+  r->num_read = 0;
+  r->nbytes = (w + 8 - 1) / 8;
+
+  uint32 size = BitmapSize(r->width);
+  r->bits = calloc(size > 0 ? size : 1, 1);
+  check(r->bits != NULL, "calloc");
+  r->runs = AllocateRunsBuffer(r->width);
+  return r;
+}
+
+uint32 ImageReaderWidth(const ImageReader r) {  ///
+  assert(r != NULL);
+  return r->width;
+}
+
+uint32 ImageReaderHeight(const ImageReader r) {  ///
+  assert(r != NULL);
+  return r->height;
+}
+
+void ImageReaderRead(ImageReader r, Image rows) {  ///
+  assert(r != NULL && rows != NULL);
+  check(rows->width == r->width, "As imagens têm tamanhos diferentes!\n");
+  check(rows->height <= r->height - r->num_read, "Reading pixels");
+
+  // (The old rows of the image are a good estimate of the size of the new)
+  uint32 num_old = RestartArena(rows, ArenaUsed(rows));
+  for (uint32 h = 0; h < rows->height; h++) {
+    check(fread(r->bits, sizeof(uint8), r->nbytes, r->f) == (size_t)r->nbytes,
+          "Reading pixels");
+    rows->row[h] = StoreBitmapRow(rows, r->bits, r->width, r->runs);
+  }
+  ReleaseArena(rows, num_old);
+  r->num_read += rows->height;
+}
+
+void ImageReaderClose(ImageReader* rp) {  ///
+  assert(rp != NULL);
+  ImageReader r = *rp;
+  if (r == NULL) return;
+  fclose(r->f);
+  free(r->runs);
+  free(r->bits);
+  free(r);
+  *rp = NULL;
+}
+
+ImageWriter ImageWriterOpen(const char* filename, uint32 width,
+                            uint32 height) {  ///
+  ImageWriter w = malloc(sizeof(struct imageWriter));
+  check(w != NULL, "malloc");
+
+  check((w->f = fopen(filename, "wb")) != NULL, "Open failed");
+  check(fprintf(w->f, "P4\n%u %u\n", width, height) > 0,
+        "Writing header failed");
+  w->width = width;
+  w->height = height;
+  w->num_written = 0;
+  w->nbytes = (width + 8 - 1) / 8;
+
+  // The rows are packed into a buffer, written in batches
+  w->batch = w->nbytes > 0 ? BatchRows(w->nbytes, height) : 0;
+  w->bytes = malloc((size_t)w->batch * w->nbytes + 1);
+  check(w->bytes != NULL, "malloc");
+  w->num_buffered = 0;
+  return w;
+}
+
+/// Write the rows buffered by writer w to its file
+static void FlushWriter(ImageWriter w) {
+  size_t n = (size_t)w->num_buffered * w->nbytes;
+  check(fwrite(w->bytes, sizeof(uint8), n, w->f) == n, "Writing pixels failed");
+  w->num_buffered = 0;
+}
+
+void ImageWriterWrite(ImageWriter w, const Image rows) {  ///
+  assert(w != NULL && rows != NULL);
+  check(rows->width == w->width, "As imagens têm tamanhos diferentes!\n");
+  check(rows->height <= w->height - w->num_written, "Writing pixels failed");
+
+  for (uint32 h = 0; h < rows->height; h++) {
+    if (w->num_buffered == w->batch) FlushWriter(w);
+    PackRow(rows->row[h], w->width,
+            w->bytes + (size_t)w->num_buffered * w->nbytes);
+    w->num_buffered++;
+  }
+  w->num_written += rows->height;
+}
+
+void ImageWriterClose(ImageWriter* wp) {  ///
+  assert(wp != NULL);
+  ImageWriter w = *wp;
+  if (w == NULL) return;
+  check(w->num_written == w->height, "Writing pixels failed");
+  FlushWriter(w);
+  fclose(w->f);
+  free(w->bytes);
+  free(w);
+  *wp = NULL;
+}
+
+// Native RLE files
+//
+// An RBW file holds the compressed rows of an image just as they are
+// stored in memory, so loading it requires no decoding:
+//   RBWHeader                 (magic "RBW1", size, checksum)
+//   uint64 index[height]      (offset of each row in the data | color)
+//   uint8 data[data_size]     (RowHeader + runs of each row, padded to
+//                              ROW_ALIGN bytes; a row repeated in
+//                              consecutive rows of the image is stored once)
+// The offsets are multiples of ROW_ALIGN, so the low bit of each index
+// entry is free to keep the color of the first pixel of the row.
+// Numbers are stored in the byte order of the machine.
+
+typedef struct {
+  char magic[4];     // "RBW1"
+  uint32 width;
+  uint32 height;
+  uint32 reserved;   // always 0
+  uint64 data_size;  // number of bytes of rows
+  uint64 checksum;   // of the index and the rows (see ChecksumRBW)
+} RBWHeader;
+
+/// Size of a row in an RBW file (or in the arena), with its padding
+static inline size_t PaddedRowSize(const RowHeader* row) {
+  return (GetSizeRLERow(row) + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+}
+
+/// Add a stored row to the checksum of the rows of an RBW file.
+/// (It starts at 0 and goes through the stored rows in the order of the
+/// file, ignoring the padding. The checksum of the file is that of the rows
+/// XOR the hash of the index.)
+static inline uint64 ChecksumRBW(uint64 sum, const RowHeader* row) {
+  return (sum ^ HashBytes(row, GetSizeRLERow(row))) * 0x9E3779B97F4A7C15ull;
+}
+
+/// Check that a row of an RBW file, at the given offset in data,
+/// is well formed for an image of the given width: its runs (decoded
+/// into runs, with room for width runs, without reading past the row)
+/// are not empty and fill the width exactly, and they are encoded as
+/// StoreRLERow would encode them (so equal rows are still equal bytes).
+static void CheckRBWRow(const uint8* data, uint64 data_size, uint64 offset,
+                        uint32 width, uint32* runs) {
+  check(offset % ROW_ALIGN == 0 && offset + sizeof(RowHeader) <= data_size,
+        "Invalid row offset");
+  const RowHeader* row = (const RowHeader*)(data + offset);
+  uint32 n = row->num_runs;
+  uint32 size = row->size;
+  check(size <= data_size - offset - sizeof(RowHeader) && n >= 1 &&
+            n <= width && row->unused[0] == 0 && row->unused[1] == 0 &&
+            row->unused[2] == 0,
+        "Invalid row");
+
+  const uint8* p = (const uint8*)(row + 1);
+  const uint8* end = p + size;
+  uint64 total = 0;
+  int valid = 1;
+  if (row->enc == BITMAP) {
+    // Bit 0 and the padding are 0, and the runs are counted right
+    uint32 last = (width - 1) >> 3;  // last byte with pixels
+    valid = size == BitmapSize(width) && GetBit(p, 0) == 0 &&
+            (p[last] & (0xFF >> (((width - 1) & 7) + 1))) == 0;
+    for (uint32 i = last + 1; valid && i < size; i++) valid = p[i] == 0;
+    uint32 k = 0;
+    uint8 bit = 0;
+    for (uint32 x = 0; valid && x < width; bit ^= 1) {
+      uint32 next = ScanBits(p, x, width, bit);
+      runs[k++] = next - x;
+      x = next;
+    }
+    valid = valid && k == n;
+    total = width;
+  } else if (row->enc <= RUNVAR) {
+    for (uint32 i = 0; valid && i < n; i++) {
+      uint32 run = 0;
+      if (row->enc == RUN8) {
+        valid = p < end;
+        if (valid) run = *p++;
+      } else if (row->enc == RUN16) {
+        uint16 r16 = 0;
+        valid = end - p >= 2;
+        if (valid) memcpy(&r16, p, sizeof(r16));
+        run = r16;
+        p += valid ? 2 : 0;
+      } else {
+        // (At most 5 bytes, the last one ending the varint)
+        int shift = 0;
+        uint8 byte = 0x80;
+        while (valid && (byte & 0x80)) {
+          valid = p < end && shift < 32;
+          if (valid) {
+            byte = *p++;
+            run |= (uint32)(byte & 0x7F) << shift;
+            shift += 7;
+          }
+        }
+      }
+      valid = valid && run >= 1;
+      runs[i] = run;
+      total += run;
+    }
+    valid = valid && p == end;
+  } else {
+    valid = 0;
+  }
+  valid = valid && total == width;
+
+  if (valid) {
+    uint8 enc;
+    valid = ChooseRunEncoding(runs, n, &enc) == size && enc == row->enc;
+  }
+  check(valid, "Invalid row");
+}
+
+int ImageSaveRBW(const Image img, const char* filename) {  ///
+  assert(img != NULL);
+  uint32 h = img->height;
+
+  // Lay out the rows, computing the index and the checksum
+  uint64* index = malloc((size_t)h * sizeof(uint64));
+  check(index != NULL, "malloc");
+  uint64 data_size = 0;
+  uint64 checksum = 0;
+  for (uint32 i = 0; i < h; i++) {
+    const RowHeader* row = img->row[i].rle;
+    if (i > 0 && row == img->row[i - 1].rle) {
+      index[i] = (index[i - 1] & ~(uint64)1) | img->row[i].color;
+    } else {
+      index[i] = data_size | img->row[i].color;
+      data_size += PaddedRowSize(row);
+      checksum = ChecksumRBW(checksum, row);
+    }
+  }
+  checksum ^= HashBytes(index, (size_t)h * sizeof(uint64));
+
+  FILE* f = NULL;
+  check((f = fopen(filename, "wb")) != NULL, "Open failed");
+  RBWHeader header = {{'R', 'B', 'W', '1'}, img->width, h, 0, data_size,
+                      checksum};
+  check(fwrite(&header, sizeof(header), 1, f) == 1, "Writing header failed");
+  check(fwrite(index, sizeof(uint64), h, f) == h, "Writing index failed");
+  static const uint8 zeros[ROW_ALIGN];
+  for (uint32 i = 0; i < h; i++) {
+    if (i > 0 && img->row[i].rle == img->row[i - 1].rle) continue;
+    const RowHeader* row = img->row[i].rle;
+    size_t n = GetSizeRLERow(row);
+    size_t padding = PaddedRowSize(row) - n;
+    check(fwrite(row, 1, n, f) == n && fwrite(zeros, 1, padding, f) == padding,
+          "Writing pixels failed");
+  }
+  free(index);
+
+  check(fclose(f) == 0, "Writing pixels failed");
+  return 0;
+}
+
+/// Open an RBW file and read its header
+static FILE* OpenRBW(const char* filename, RBWHeader* header) {
+  FILE* f = NULL;
+  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  check(fread(header, sizeof(*header), 1, f) == 1 &&
+            memcmp(header->magic, "RBW1", 4) == 0 && header->reserved == 0,
+        "Invalid file format");
+  check(header->width > 0, "Invalid width");
+  check(header->height > 0, "Invalid height");
+  check(header->data_size % ROW_ALIGN == 0, "Invalid file format");
+
+  // (The sizes in the header must be those of the file)
+  long file_size;
+  check(fseek(f, 0, SEEK_END) == 0 && (file_size = ftell(f)) >= 0 &&
+            fseek(f, sizeof(*header), SEEK_SET) == 0,
+        "Reading header");
+  check(header->data_size <= (uint64)file_size &&
+            (uint64)file_size - sizeof(*header) ==
+                (uint64)header->height * sizeof(uint64) + header->data_size,
+        "Invalid file format");
+  return f;
+}
+
+Image ImageLoadRBW(const char* filename) {  ///
+  RBWHeader header;
+  FILE* f = OpenRBW(filename, &header);
+  uint32 h = header.height;
+
+  // The rows are read at once into the (only) arena block of the image
+  Image img = AllocateImageHeader(header.width, h, header.data_size + 1);
+  uint64* index = malloc((size_t)h * sizeof(uint64));
+  check(index != NULL, "malloc");
+  check(fread(index, sizeof(uint64), h, f) == h, "Reading index");
+  uint8* data = img->fill->data;
+  check(fread(data, 1, header.data_size, f) == header.data_size,
+        "Reading pixels");
+  img->fill->used = header.data_size;
+  fclose(f);
+
+  // Verify the checksum, going through the stored rows
+  uint32* runs = AllocateRunsBuffer(header.width);
+  uint64 checksum = 0;
+  for (uint64 offset = 0; offset < header.data_size;) {
+    CheckRBWRow(data, header.data_size, offset, header.width, runs);
+    const RowHeader* row = (const RowHeader*)(data + offset);
+    checksum = ChecksumRBW(checksum, row);
+    offset += PaddedRowSize(row);
+  }
+  checksum ^= HashBytes(index, (size_t)h * sizeof(uint64));
+  check(checksum == header.checksum, "Checksum mismatch");
+
+  // (An index entry may still point inside a row: the checksum only
+  // detects accidents, so each row the index points to is checked)
+  for (uint32 i = 0; i < h; i++) {
+    uint64 offset = index[i] & ~(uint64)1;
+    if (i == 0 || offset != (index[i - 1] & ~(uint64)1)) {
+      CheckRBWRow(data, header.data_size, offset, header.width, runs);
+    }
+    img->row[i].rle = (const RowHeader*)(data + offset);
+    img->row[i].color = index[i] & 1;
+  }
+  free(runs);
+  free(index);
+  return img;
+}
+
+Image ImageLoadRBWRows(const char* filename, uint32 first,
+                       uint32 count) {  ///
+  RBWHeader header;
+  FILE* f = OpenRBW(filename, &header);
+  check(count > 0 && first < header.height &&
+            count <= header.height - first,
+        "Invalid row range");
+
+  // Read the index entries of the rows
+  uint64* index = malloc((size_t)count * sizeof(uint64));
+  check(index != NULL, "malloc");
+  check(fseek(f, sizeof(header) + (long)first * sizeof(uint64), SEEK_SET) == 0 &&
+            fread(index, sizeof(uint64), count, f) == count,
+        "Reading index");
+
+  // Read only the part of the data holding those rows:
+  // from the first of them to the end of the last one
+  uint64 lo = UINT64_MAX;
+  uint64 hi = 0;
+  for (uint32 i = 0; i < count; i++) {
+    uint64 offset = index[i] & ~(uint64)1;
+    if (offset < lo) lo = offset;
+    if (offset > hi) hi = offset;
+  }
+  long data_pos = sizeof(header) + (long)header.height * sizeof(uint64);
+  RowHeader last;
+  check(hi + sizeof(RowHeader) <= header.data_size &&
+            fseek(f, data_pos + (long)hi, SEEK_SET) == 0 &&
+            fread(&last, sizeof(last), 1, f) == 1,
+        "Invalid row offset");
+  uint64 end = hi + PaddedRowSize(&last);
+  check(end <= header.data_size, "Invalid row");
+
+  Image img = AllocateImageHeader(header.width, count, end - lo);
+  uint8* data = img->fill->data;
+  check(fseek(f, data_pos + (long)lo, SEEK_SET) == 0 &&
+            fread(data, 1, end - lo, f) == end - lo,
+        "Reading pixels");
+  img->fill->used = end - lo;
+  fclose(f);
+
+  // (The checksum covers the whole file, so it cannot be verified here;
+  // but each row is decoded and checked, so no malformed row is loaded)
+  uint32* runs = AllocateRunsBuffer(header.width);
+  for (uint32 i = 0; i < count; i++) {
+    uint64 offset = (index[i] & ~(uint64)1) - lo;
+    if (i == 0 || index[i] >> 1 != index[i - 1] >> 1) {
+      CheckRBWRow(data, end - lo, offset, header.width, runs);
+    }
+    img->row[i].rle = (const RowHeader*)(data + offset);
+    img->row[i].color = index[i] & 1;
+  }
+  free(runs);
+  free(index);
+  return img;
+}
+
+/// Information queries
+
+/// Get image width
+int ImageWidth(const Image img) {
+  assert(img != NULL);
+  return img->width;
+}
+
+/// Get image height
 int ImageHeight(const Image img) {
   assert(img != NULL);
   return img->height;
@@ -501,6 +2112,255 @@ int ImageHeight(const Image img) {
 
 /// Image comparison
 
+// Equal rows are always encoded in the same way, so the hash of a row is
+// the hash of its bytes (complemented, if its first pixel is BLACK).
+// The hashes of the rows of an image, and the hash of the whole image, are
+// computed when first needed and kept until the rows change.
+
+/// Term of row i, with hash row_hash, in the hash of an image
+static inline uint64 RowHashTerm(uint64 row_hash, uint32 i) {
+  uint64 h = row_hash + (i + 1) * 0x9E3779B97F4A7C15ull;
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ull;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBull;
+  h ^= h >> 31;
+  return h;
+}
+
+/// Hash of the image with the given row hashes.
+/// (It is a sum of terms, one per row, so replacing a row only
+/// replaces its term.)
+static uint64 CombineRowHashes(uint32 width, uint32 height,
+                               const uint64* row_hash) {
+  uint64 h = ((uint64)width << 32 | height) * 0xC2B2AE3D27D4EB4Full;
+  for (uint32 i = 0; i < height; i++) {
+    h += RowHashTerm(row_hash[i], i);
+  }
+  return h;
+}
+
+/// Compute the hashes of the rows of img (unless known)
+static void ComputeHashes(Image img) {
+  if (img->row_hash != NULL) return;
+  uint64* row_hash = malloc(img->height * sizeof(uint64));
+  check(row_hash != NULL, "malloc");
+
+  uint64 bytes_hash = 0;
+  for (uint32 i = 0; i < img->height; i++) {
+    const RowHeader* row = img->row[i].rle;
+    // (A row repeated in consecutive rows is hashed once)
+    if (i == 0 || row != img->row[i - 1].rle) {
+      bytes_hash = HashBytes(row, GetSizeRLERow(row));
+    }
+    row_hash[i] = img->row[i].color ? ~bytes_hash : bytes_hash;
+  }
+
+  img->row_hash = row_hash;
+  img->hash = CombineRowHashes(img->width, img->height, row_hash);
+}
+
+uint64 ImageHash(const Image img) {  ///
+  assert(img != NULL);
+  ComputeHashes(img);
+  return img->hash;
+}
+
+/// Number of BLACK pixels in the runs of a row, with the given first pixel
+static uint32 CountBlackRuns(const uint32* runs, uint32 n, uint8 color) {
+  uint32 count = 0;
+  for (uint32 i = color == BLACK ? 0 : 1; i < n; i += 2) count += runs[i];
+  return count;
+}
+
+/// Number of 1 bits among the first width bits of a bitmap
+/// (with BitmapSize(width) bytes)
+static uint32 CountBits(const uint8* bits, uint32 width) {
+  uint32 count = 0;
+  uint32 i = 0;
+  for (; 64 * (i + 1) <= width; i++) count += PopCount64(LoadBits64(bits + 8 * i));
+  if (64 * i < width) {
+    count += PopCount64(LoadBits64(bits + 8 * i) >> (64 - (width - 64 * i)));
+  }
+  return count;
+}
+
+/// Number of BLACK pixels of a row (of an image with the given width)
+static uint32 CountBlackRow(RowRef row, uint32 width) {
+  // (Count the pixels that differ from the first one)
+  uint32 count = 0;
+  if (row.rle->enc == BITMAP) {
+    count = CountBits((const uint8*)(row.rle + 1), width);
+  } else {
+    RunReader reader = ReadRuns(row.rle, width);
+    for (uint32 i = 0; i < row.rle->num_runs; i++) {
+      uint32 run = NextRun(&reader);
+      if (i & 1) count += run;
+    }
+  }
+  return row.color == BLACK ? width - count : count;
+}
+
+/// Compute the numbers of BLACK pixels of the rows of img (unless known)
+static void ComputeCounts(Image img) {
+  if (img->row_black != NULL) return;
+  uint32* row_black = NewCounts(img->height);
+  for (uint32 i = 0; i < img->height; i++) {
+    // (A row repeated in consecutive rows is counted once)
+    if (i > 0 && img->row[i].rle == img->row[i - 1].rle) {
+      row_black[i] = img->row[i].color == img->row[i - 1].color
+                         ? row_black[i - 1]
+                         : img->width - row_black[i - 1];
+    } else {
+      row_black[i] = CountBlackRow(img->row[i], img->width);
+    }
+  }
+  SetCounts(img, row_black);
+}
+
+uint64 ImageCountBlack(const Image img) {  ///
+  assert(img != NULL);
+  ComputeCounts(img);
+  return img->black;
+}
+
+uint32 ImageRowCountBlack(const Image img, uint32 y) {  ///
+  assert(img != NULL);
+  assert(y < img->height);
+  ComputeCounts(img);
+  return img->row_black[y];
+}
+
+/// Rebuild the run ends of the index of img with only those in use
+static void CompactRunEnds(Image img) {
+  PixelIndex* index = img->index;
+  size_t live = 0;
+  for (uint32 y = 0; y < img->height; y++) {
+    if (index->start[y] != 0 &&
+        (y == 0 || index->start[y] != index->start[y - 1])) {
+      live += img->row[y].rle->num_runs;
+    }
+  }
+
+  uint32* ends = malloc((live + 1) * sizeof(uint32));
+  check(ends != NULL, "malloc");
+  size_t used = 0;
+  size_t prev = 0;  // old start of the previous row
+  for (uint32 y = 0; y < img->height; y++) {
+    size_t start = index->start[y];
+    if (start != 0 && y > 0 && start == prev) {
+      index->start[y] = index->start[y - 1];
+    } else if (start != 0) {
+      uint32 n = img->row[y].rle->num_runs;
+      memcpy(ends + used, index->ends + start - 1, n * sizeof(uint32));
+      index->start[y] = 1 + used;
+      used += n;
+    }
+    prev = start;
+  }
+
+  free(index->ends);
+  index->ends = ends;
+  index->used = used;
+  index->size = live + 1;
+  index->dead = 0;
+}
+
+/// Forget the run ends of row y of img, which is being replaced.
+/// (Their entries are reclaimed later, see RunEnds.)
+static void DropRunEnds(Image img, uint32 y) {
+  PixelIndex* index = img->index;
+  size_t start = index->start[y];
+  if (start == 0) return;
+  index->start[y] = 0;
+  // (Unless a neighbor row shares them)
+  if ((y == 0 || index->start[y - 1] != start) &&
+      (y + 1 == img->height || index->start[y + 1] != start)) {
+    index->dead += img->row[y].rle->num_runs;
+  }
+}
+
+/// The run ends of row y of img (computed if not known yet).
+/// Once the entries of replaced rows are most of the index (and at least
+/// one per row), the index is compacted, which takes amortized constant
+/// time per entry dropped.
+/// (The pointer is valid until the run ends of another row are computed.)
+static const uint32* RunEnds(Image img, uint32 y) {
+  PixelIndex* index = img->index;
+  if (index == NULL) {
+    index = calloc(1, sizeof(PixelIndex) + img->height * sizeof(size_t));
+    check(index != NULL, "calloc");
+    img->index = index;
+  }
+  if (index->start[y] == 0) {
+    if (y > 0 && img->row[y].rle == img->row[y - 1].rle &&
+        index->start[y - 1] != 0) {
+      // (A row repeated in consecutive rows shares its run ends)
+      index->start[y] = index->start[y - 1];
+    } else {
+      const RowHeader* row = img->row[y].rle;
+      uint32 n = row->num_runs;
+      if (2 * index->dead >= index->used && index->dead >= img->height) {
+        CompactRunEnds(img);
+      }
+      if (index->size - index->used < n) {
+        index->size = 2 * index->size + n;
+        index->ends = realloc(index->ends, index->size * sizeof(uint32));
+        check(index->ends != NULL, "realloc");
+      }
+      uint32* ends = index->ends + index->used;
+      RunReader reader = ReadRuns(row, img->width);
+      uint32 x = 0;
+      for (uint32 i = 0; i < n; i++) {
+        x += NextRun(&reader);
+        ends[i] = x;
+      }
+      index->start[y] = 1 + index->used;
+      index->used += n;
+    }
+  }
+  return index->ends + index->start[y] - 1;
+}
+
+/// Value of pixel (x, y) of img
+static inline uint8 ProbePixel(Image img, uint32 x, uint32 y) {
+  RowRef row = img->row[y];
+  if (row.rle->enc == BITMAP) {
+    return row.color ^ GetBit((const uint8*)(row.rle + 1), x);
+  }
+  uint32 n = row.rle->num_runs;
+  if (n == 1) return row.color;
+
+  // Find the first run that ends after x
+  const uint32* ends = RunEnds(img, y);
+  uint32 lo = 0;
+  uint32 hi = n - 1;  // (the last run ends at width, after x)
+  while (lo < hi) {
+    uint32 mid = (lo + hi) / 2;
+    if (ends[mid] > x) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return row.color ^ (lo & 1);
+}
+
+uint8 ImageGetPixel(const Image img, uint32 x, uint32 y) {  ///
+  assert(img != NULL);
+  assert(x < img->width && y < img->height);
+  return ProbePixel(img, x, y);
+}
+
+void ImageGetPixels(const Image img, uint32 n, const uint32 x[],
+                    const uint32 y[], uint8 values[]) {  ///
+  assert(img != NULL);
+  for (uint32 i = 0; i < n; i++) {
+    assert(x[i] < img->width && y[i] < img->height);
+    values[i] = ProbePixel(img, x[i], y[i]);
+  }
+}
+
 int ImageIsEqual(const Image img1, const Image img2) {
   assert(img1 != NULL && img2 != NULL);
   
@@ -508,35 +2368,726 @@ int ImageIsEqual(const Image img1, const Image img2) {
   check(img1->width==img2->width, "A largura das imagens não é igual");
   check(img1->height==img2->height, "A altura das imagens não é igual");
 
-  uint32 height = img1->height;
+  if (img1 == img2) return 1;
+
+  // Images with different hashes are different
+  // (once computed, comparing them again costs nothing)
+  if (ImageHash(img1) != ImageHash(img2)) return 0;
+
+  uint32 height = img1->height;
+
+  for (uint32 h=0; h<height; h++) {
+    // Equal rows are always encoded in the same way:
+    // rows with different hashes are different, and
+    // rows with equal hashes are compared byte by byte
+    // (unless they are the same row: shared or interned)
+    const RowHeader* row1 = img1->row[h].rle;
+    const RowHeader* row2 = img2->row[h].rle;
+    if (img1->row[h].color != img2->row[h].color) {
+      return 0;
+    }
+    if (row1 == row2) {
+      continue;
+    }
+    if (img1->row_hash[h] != img2->row_hash[h]) {
+      return 0;
+    }
+    if (memcmp(row1, row2, sizeof(RowHeader)) != 0 ||
+        memcmp(row1 + 1, row2 + 1, row1->size) != 0) {
+      return 0;
+    }
+  }
+
+  return 1; //As imagens são iguais
+}
+
+int ImageIsDifferent(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  return !ImageIsEqual(img1, img2);
+}
+
+/// The run ends of row y of img, if already computed (NULL otherwise).
+/// (Unlike RunEnds, this never changes img, so threads may call it.)
+static const uint32* KnownRunEnds(const Image img, uint32 y) {
+  if (img->index == NULL || img->index->start[y] == 0) return NULL;
+  return img->index->ends + img->index->start[y] - 1;
+}
+
+/// Slice pixels [x0, x1) out of a row of an image of the given width.
+/// If the run ends of the row are known (ends != NULL), the first run of
+/// the slice is found by binary search; otherwise the runs are decoded up
+/// to x1 (a BITMAP row is scanned from x0).
+/// The runs of the slice go to runs, and its first pixel to (*color).
+/// Returns the number of runs of the slice.
+static uint32 SliceRow(RowRef row, uint32 width, const uint32* ends,
+                       uint32 x0, uint32 x1, uint32* runs, uint8* color) {
+  assert(x0 < x1 && x1 <= width);
+  uint32 n = 0;
+
+  if (row.rle->enc == BITMAP) {
+    const uint8* bits = (const uint8*)(row.rle + 1);
+    uint8 cur = GetBit(bits, x0);
+    *color = row.color ^ cur;
+    for (uint32 x = x0; x < x1; cur ^= 1) {
+      uint32 end = ScanBits(bits, x, x1, cur);
+      runs[n++] = end - x;
+      x = end;
+    }
+  } else if (ends != NULL) {
+    // Find the first run that ends after x0
+    uint32 lo = 0;
+    uint32 hi = row.rle->num_runs - 1;
+    while (lo < hi) {
+      uint32 mid = (lo + hi) / 2;
+      if (ends[mid] > x0) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    *color = row.color ^ (lo & 1);
+    uint32 x = x0;
+    for (uint32 i = lo; x < x1; i++) {
+      uint32 end = ends[i] < x1 ? ends[i] : x1;
+      runs[n++] = end - x;
+      x = end;
+    }
+  } else {
+    RunReader reader = ReadRuns(row.rle, width);
+    uint32 i = 0;
+    uint32 end = NextRun(&reader);
+    while (end <= x0) {
+      end += NextRun(&reader);
+      i++;
+    }
+    *color = row.color ^ (i & 1);
+    uint32 x = x0;
+    while (1) {
+      runs[n++] = (end < x1 ? end : x1) - x;
+      if (end >= x1) break;
+      x = end;
+      end += NextRun(&reader);
+    }
+  }
+  return n;
+}
+
+/// Pixel editing
+
+// Rows are never modified (they may be shared with other images), so an
+// edit stores a new version of each row it changes in the arena of the
+// image, which grows by doubling: appending a row takes amortized time
+// proportional to its size. The rows not edited, and the rows edited into
+// rows the image already had, are kept.
+
+/// Writer of the runs of a row, merging runs of the same color
+typedef struct {
+  uint32* runs;  // the runs written
+  uint32 n;      // number of runs written
+  uint8 first;   // color of the first run
+  uint8 last;    // color of the last run
+} RunWriter;
+
+static inline void EmitRun(RunWriter* w, uint32 len, uint8 color) {
+  if (len == 0) return;
+  if (w->n > 0 && color == w->last) {
+    w->runs[w->n - 1] += len;
+    return;
+  }
+  if (w->n == 0) w->first = color;
+  w->runs[w->n++] = len;
+  w->last = color;
+}
+
+/// Paint pixels [x0, x1) of the row with the n given runs, and first pixel
+/// (*color), with color c.
+/// The runs of the painted row go to out (which must have room for n+2
+/// runs), and its first pixel to (*color).
+/// Returns the number of runs of the painted row.
+static uint32 PaintRuns(const uint32* runs, uint32 n, uint8* color,
+                        uint32 x0, uint32 x1, uint8 c, uint32* out) {
+  assert(x0 < x1);
+  RunWriter w = {out, 0, 0, 0};
+  uint8 col = *color;
+  uint32 start = 0;
+  for (uint32 i = 0; i < n; i++) {
+    uint32 end = start + runs[i];
+    if (start < x0) EmitRun(&w, (end < x0 ? end : x0) - start, col);
+    if (start <= x0 && x0 < end) EmitRun(&w, x1 - x0, c);
+    if (end > x1) EmitRun(&w, end - (start > x1 ? start : x1), col);
+    start = end;
+    col ^= 1;
+  }
+  *color = w.first;
+  return w.n;
+}
+
+// Edited rows are stored anew, and the rows they replace stay in the arena.
+// The bytes of the replaced rows that no row uses any longer, in blocks that
+// only the image references, are counted as garbage; when the garbage
+// exceeds the rows still in use there, those rows are copied to a new block
+// and the old blocks released.
+
+/// Slot of an address in a hash table with capacity slots (a power of 2)
+static inline size_t AddressSlot(const void* p, size_t capacity) {
+  uint64 h = ((uintptr_t)p >> 2) * 0x9E3779B97F4A7C15ull;
+  return (size_t)(h >> 32) & (capacity - 1);
+}
+
+/// Allocate an empty table of row uses with the given number of slots
+static RowUses* AllocateRowUses(uint32 capacity) {
+  RowUses* table = calloc(1, sizeof(RowUses) + capacity * sizeof(table->slot[0]));
+  check(table != NULL, "calloc");
+  table->capacity = capacity;
+  return table;
+}
+
+/// The number of uses of row in table, inserted (with 0 uses) if absent.
+/// The table must have room for one more row.
+static uint32* RowUsesOf(RowUses* table, const RowHeader* row) {
+  size_t i = AddressSlot(row, table->capacity);
+  while (table->slot[i].rle != NULL && table->slot[i].rle != row) {
+    i = (i + 1) & (table->capacity - 1);
+  }
+  if (table->slot[i].rle == NULL) {
+    table->slot[i].rle = row;
+    table->count++;
+  }
+  return &table->slot[i].uses;
+}
+
+/// A table of row uses with room for more rows than the n rows of
+/// old (or of img, if old is NULL) with uses, and the uses of those rows
+static RowUses* CountRowUses(const Image img, const RowUses* old, uint32 n) {
+  uint32 capacity = 16;
+  while (capacity < 4 * n) capacity *= 2;
+  RowUses* table = AllocateRowUses(capacity);
+  if (old != NULL) {
+    for (uint32 i = 0; i < old->capacity; i++) {
+      if (old->slot[i].uses > 0) {
+        *RowUsesOf(table, old->slot[i].rle) = old->slot[i].uses;
+      }
+    }
+  } else {
+    for (uint32 y = 0; y < img->height; y++) {
+      (*RowUsesOf(table, img->row[y].rle))++;
+    }
+  }
+  return table;
+}
+
+/// Count one more use of row by the rows of img
+static void AddRowUse(Image img, const RowHeader* row) {
+  RowUses* table = img->uses;
+  if (2 * (table->count + 1) > table->capacity) {
+    // Full: drop the rows with no uses left, and make room
+    uint32 n = 0;
+    for (uint32 i = 0; i < table->capacity; i++) n += table->slot[i].uses > 0;
+    img->uses = CountRowUses(img, table, n + 1);
+    free(table);
+  }
+  (*RowUsesOf(img->uses, row))++;
+}
+
+/// The block of the arena of img that holds row (or NULL)
+static const Arena* FindArenaBlock(const Image img, const RowHeader* row) {
+  const uint8* p = (const uint8*)row;
+  for (uint32 i = img->num_arenas; i > 0; i--) {
+    const Arena* block = img->arena[i - 1];
+    if (p >= block->data && p < block->data + block->used) return block;
+  }
+  return NULL;
+}
+
+static int CompareArenaBlocks(const void* a, const void* b) {
+  uintptr_t pa = (uintptr_t)*(Arena* const*)a;
+  uintptr_t pb = (uintptr_t)*(Arena* const*)b;
+  return pa < pb ? -1 : (pa > pb);
+}
+
+/// Whether row is in one of the n blocks of owned (sorted by address)
+static int InBlocks(Arena* const* owned, uint32 n, const RowHeader* row) {
+  const uint8* p = (const uint8*)row;
+  uint32 lo = 0;
+  while (n > 0) {
+    uint32 half = n / 2;
+    if ((const uint8*)owned[lo + half] < p) {
+      lo += half + 1;
+      n -= half + 1;
+    } else {
+      n = half;
+    }
+  }
+  // owned[lo - 1] is the last block that starts before p
+  return lo > 0 && p < owned[lo - 1]->data + owned[lo - 1]->used;
+}
+
+// Table of the rows moved by CompactArena: old address -> new address
+typedef struct {
+  const RowHeader* from;
+  const RowHeader* to;
+} RowMove;
+
+/// The slot of row in a table of moves with capacity slots (a power of 2)
+static RowMove* FindRowMove(RowMove* move, size_t capacity,
+                            const RowHeader* row) {
+  size_t i = AddressSlot(row, capacity);
+  while (move[i].from != NULL && move[i].from != row) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &move[i];
+}
+
+/// Copy the rows of img stored in blocks that no other image references
+/// to a new block, and release those blocks (with the garbage they hold).
+static void CompactArena(Image img) {
+  // The blocks only img references, sorted by address
+  Arena** owned = malloc((img->num_arenas + 1) * sizeof(Arena*));
+  check(owned != NULL, "malloc");
+  uint32 num_owned = 0;
+  uint32 kept = 0;
+  size_t used = 0;
+  for (uint32 i = 0; i < img->num_arenas; i++) {
+    Arena* block = img->arena[i];
+    if (block->refcount == 1) {
+      owned[num_owned++] = block;
+      used += block->used;
+    } else {
+      img->arena[kept++] = block;
+    }
+  }
+  qsort(owned, num_owned, sizeof(Arena*), CompareArenaBlocks);
+  img->num_arenas = kept;
+
+  // Room for the rows in use, and as many new ones
+  size_t live = used > img->garbage ? used - img->garbage : 0;
+  size_t capacity = 2 * live < 4096 ? 4096 : 2 * live;
+  Arena* block = img->spare;
+  if (block != NULL && block->size >= capacity) {
+    img->spare = NULL;
+  } else {
+    block = AllocateArenaBlock(capacity);
+  }
+  img->fill = block;
+  AddArenaBlock(img, block);
+
+  size_t slots = 2;
+  while (slots < 2 * (size_t)img->height) slots *= 2;
+  RowMove* move = calloc(slots, sizeof(RowMove));
+  check(move != NULL, "calloc");
+
+  // Copy each row once: rows shared by several rows stay shared
+  const RowHeader* prev = NULL;
+  const RowHeader* prev_to = NULL;
+  for (uint32 y = 0; y < img->height; y++) {
+    const RowHeader* row = img->row[y].rle;
+    if (row != prev) {
+      prev = row;
+      if (InBlocks(owned, num_owned, row)) {
+        RowMove* m = FindRowMove(move, slots, row);
+        if (m->from == NULL) {
+          RowHeader* copy = AllocateRLERow(img, row->size);
+          memcpy(copy, row, GetSizeRLERow(row));
+          m->from = row;
+          m->to = copy;
+        }
+        row = m->to;
+      }
+      prev_to = row;
+    }
+    img->row[y].rle = prev_to;
+  }
+
+  // The interned rows: the moved ones at their new address, the dead ones
+  // forgotten
+  RowDict* dict = img->dict;
+  if (dict != NULL) {
+    RowDict* moved = AllocateRowDict(dict->capacity);
+    for (uint32 j = 0; j < dict->capacity; j++) {
+      const RowHeader* row = dict->slot[j].rle;
+      if (row == NULL) continue;
+      if (InBlocks(owned, num_owned, row)) {
+        RowMove* m = FindRowMove(move, slots, row);
+        if (m->from == NULL) continue;
+        row = m->to;
+      }
+      RowDictInsert(moved, dict->slot[j].hash, row);
+    }
+    free(dict);
+    img->dict = moved;
+  }
+
+  for (uint32 i = 0; i < num_owned; i++) {
+    ReleaseArenaBlock(img, owned[i]);
+  }
+  img->garbage = 0;
+  // (The rows moved: their uses are counted again when needed)
+  free(img->uses);
+  img->uses = NULL;
+  free(move);
+  free(owned);
+}
+
+/// Compact the arena of img if the garbage of its edits exceeds
+/// the rows in use in the blocks it alone references
+static void CollectGarbage(Image img) {
+  // (Compacting scans the row table, so a few bytes per row are needed)
+  if (img->garbage < img->height * sizeof(RowRef)) return;
+  size_t used = 0;
+  for (uint32 i = 0; i < img->num_arenas; i++) {
+    if (img->arena[i]->refcount == 1) used += img->arena[i]->used;
+  }
+  if (2 * img->garbage > used) CompactArena(img);
+}
+
+/// Replace row y of img by row, with black BLACK pixels (if img keeps the
+/// counts of its rows), updating the hashes, counts and run ends known.
+static void ReplaceRow(Image img, uint32 y, RowRef row, uint32 black) {
+  // The old row is garbage once no row uses it, unless other images
+  // may use its block
+  const RowHeader* old = img->row[y].rle;
+  if (old != row.rle) {
+    if (img->uses == NULL) {
+      img->uses = CountRowUses(img, NULL, img->height + 1);
+    }
+    AddRowUse(img, row.rle);
+    uint32* uses = RowUsesOf(img->uses, old);
+    assert(*uses > 0);
+    if (--*uses == 0) {
+      const Arena* block = FindArenaBlock(img, old);
+      if (block != NULL && block->refcount == 1) {
+        img->garbage += PaddedRowSize(old);
+      }
+    }
+  }
+  if (img->row_hash != NULL) {
+    uint64 bytes_hash = HashBytes(row.rle, GetSizeRLERow(row.rle));
+    uint64 row_hash = row.color ? ~bytes_hash : bytes_hash;
+    img->hash += RowHashTerm(row_hash, y) - RowHashTerm(img->row_hash[y], y);
+    img->row_hash[y] = row_hash;
+  }
+  if (img->row_black != NULL) {
+    img->black += (uint64)black - img->row_black[y];
+    img->row_black[y] = black;
+  }
+  if (img->index != NULL) {
+    DropRunEnds(img, y);
+  }
+  img->row[y] = row;
+}
+
+/// An edit of ImageApplyEdits, by its first row
+typedef struct {
+  uint32 y;  // first row of the edit
+  uint32 i;  // position of the edit
+} EditKey;
+
+static int CompareEditKeys(const void* a, const void* b) {
+  const EditKey* ka = a;
+  const EditKey* kb = b;
+  if (ka->y != kb->y) return ka->y < kb->y ? -1 : 1;
+  return ka->i < kb->i ? -1 : (ka->i > kb->i);
+}
+
+void ImageApplyEdits(Image img, const ImageEdit edits[], uint32 n) {  ///
+  assert(img != NULL);
+  assert(n == 0 || edits != NULL);
+
+  // The nonempty edits, by first row (and, in each row, in the given order)
+  EditKey* key = malloc((n + 1) * sizeof(EditKey));
+  check(key != NULL, "malloc");
+  uint32 m = 0;
+  for (uint32 i = 0; i < n; i++) {
+    const ImageEdit* e = &edits[i];
+    assert(e->x <= img->width && e->width <= img->width - e->x);
+    assert(e->y <= img->height && e->height <= img->height - e->y);
+    if (e->width > 0 && e->height > 0) {
+      key[m].y = e->y;
+      key[m].i = i;
+      m++;
+    }
+  }
+  qsort(key, m, sizeof(EditKey), CompareEditKeys);
+
+  // The edits covering the current row, in the given order
+  uint32* active = malloc((m + 1) * sizeof(uint32));
+  check(active != NULL, "malloc");
+  uint32 num_active = 0;
+
+  uint32* runs = AllocateRunsBuffer(img->width);
+  uint32* buf[2] = {AllocateRunsBuffer(img->width),
+                    AllocateRunsBuffer(img->width)};
+
+  // Consecutive equal rows under the same edits become equal rows,
+  // so each is edited once
+  uint32 version = 0;  // changes whenever the active edits change
+  uint32 prev_version = 0;
+  uint32 prev_y = UINT32_MAX;
+  RowRef prev_old = {NULL, 0};
+  RowRef prev_new = {NULL, 0};
+  uint32 prev_black = 0;
+
+  uint32 next = 0;
+  uint32 y = 0;
+  while (next < m || num_active > 0) {
+    if (num_active == 0 && key[next].y > y) y = key[next].y;
+
+    // Activate the edits starting at row y
+    while (next < m && key[next].y == y) {
+      uint32 i = key[next++].i;
+      uint32 j = num_active++;
+      for (; j > 0 && active[j - 1] > i; j--) active[j] = active[j - 1];
+      active[j] = i;
+      version++;
+    }
+
+    RowRef old = img->row[y];
+    if (prev_y + 1 == y && version == prev_version &&
+        old.rle == prev_old.rle && old.color == prev_old.color) {
+      if (prev_new.rle != old.rle || prev_new.color != old.color) {
+        ReplaceRow(img, y, prev_new, prev_black);
+      }
+    } else {
+      // Decode the row, and paint the edits in order
+      uint32 k = old.rle->num_runs;
+      RunReader reader = ReadRuns(old.rle, img->width);
+      for (uint32 r = 0; r < k; r++) runs[r] = NextRun(&reader);
+
+      const uint32* cur = runs;
+      uint8 color = old.color;
+      for (uint32 a = 0; a < num_active; a++) {
+        const ImageEdit* e = &edits[active[a]];
+        uint32* out = buf[a & 1];
+        k = PaintRuns(cur, k, &color, e->x, e->x + e->width, e->color, out);
+        cur = out;
+      }
+
+      prev_new = old;
+      if (k != old.rle->num_runs || color != old.color ||
+          memcmp(cur, runs, k * sizeof(uint32)) != 0) {
+        prev_new.rle = StoreRLERow(img, cur, k);
+        prev_new.color = color;
+        prev_black = CountBlackRuns(cur, k, color);
+        ReplaceRow(img, y, prev_new, prev_black);
+      }
+    }
+    prev_old = old;
+    prev_y = y;
+    prev_version = version;
+
+    // Deactivate the edits ending at row y
+    uint32 kept = 0;
+    for (uint32 a = 0; a < num_active; a++) {
+      const ImageEdit* e = &edits[active[a]];
+      if (e->y + e->height > y + 1) active[kept++] = active[a];
+    }
+    if (kept < num_active) version++;
+    num_active = kept;
+    y++;
+  }
+
+  free(buf[1]);
+  free(buf[0]);
+  free(runs);
+  free(active);
+  free(key);
+  CollectGarbage(img);
+}
+
+void ImageFillRect(Image img, uint32 x, uint32 y, uint32 width,
+                   uint32 height, uint8 color) {  ///
+  ImageEdit edit = {x, y, width, height, color};
+  ImageApplyEdits(img, &edit, 1);
+}
+
+void ImageSetPixel(Image img, uint32 x, uint32 y, uint8 color) {  ///
+  assert(img != NULL);
+  assert(x < img->width && y < img->height);
+  ImageFillRect(img, x, y, 1, 1, color);
+}
+
+// The merge kernel
+//
+// All binary boolean operations are computed by the same loop, which walks
+// the runs of both rows at once: at each step it consumes the shortest of
+// the two current runs, and it only ends an output run when the value of
+// the operator changes.
+// The loop is instantiated once per operator (see merge_kernel below), so
+// that evaluating the operator compiles down to a constant bit test.
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/// Value of operator op (a truth table) for pixels p1 and p2
+#define BOOLOP_VALUE(op, p1, p2) (((op) >> (2 * (p1) + (p2))) & 1)
+
+/// Merge two RLE rows of the same width, pixel by pixel, with operator op.
+/// The runs of the result are written to runs (room for width runs).
+/// Returns the number of runs, and sets (*color) to the first pixel value.
+static ALWAYS_INLINE uint32 MergeRLERows(uint8 op, uint32 width, RowRef row1,
+                                         RowRef row2, uint32* runs,
+                                         uint8* color) {
+  RunReader rd1 = ReadRuns(row1.rle, width);
+  RunReader rd2 = ReadRuns(row2.rle, width);
+  uint32 left1 = GetNumRunsInRLERow(row1.rle) - 1;  // runs of row1 still to read
+
+  uint32 cb1 = row1.color;  // current pixel values
+  uint32 cb2 = row2.color;
+  uint32 val1 = NextRun(&rd1);  // pixels left in the current runs
+  uint32 val2 = NextRun(&rd2);
+
+  uint32 cur = BOOLOP_VALUE(op, cb1, cb2);  // value of the current output run
+  uint32 len = 0;                           // length of the current output run
+  uint32 n = 0;                             // output runs completed
+  *color = (uint8)cur;
+
+  for (;;) {
+    if (BOOLOP_VALUE(op, cb1, cb2) != cur) {
+      runs[n++] = len;
+      len = 0;
+      cur ^= 1;
+    }
+    if (val1 < val2) {
+      len += val1;
+      val2 -= val1;
+      val1 = NextRun(&rd1);
+      left1--;
+      cb1 ^= 1;
+    } else if (val1 > val2) {
+      len += val2;
+      val1 -= val2;
+      val2 = NextRun(&rd2);
+      cb2 ^= 1;
+    } else {
+      len += val1;
+      if (left1 == 0) break;  // both rows end here
+      val1 = NextRun(&rd1);
+      val2 = NextRun(&rd2);
+      left1--;
+      cb1 ^= 1;
+      cb2 ^= 1;
+    }
+  }
+  runs[n++] = len;
+
+  return n;
+}
+
+typedef uint32 (*MergeKernel)(uint32 width, RowRef row1, RowRef row2,
+                              uint32* runs, uint8* color);
+
+// One instance of the merge loop per operator
+#define MERGE_KERNEL(op)                                                  \
+  static uint32 MergeRLERows##op(uint32 width, RowRef row1, RowRef row2, \
+                                 uint32* runs, uint8* color) {            \
+    return MergeRLERows(op, width, row1, row2, runs, color);              \
+  }
+MERGE_KERNEL(0x1)
+MERGE_KERNEL(0x2)
+MERGE_KERNEL(0x4)
+MERGE_KERNEL(0x6)
+MERGE_KERNEL(0x7)
+MERGE_KERNEL(0x8)
+MERGE_KERNEL(0x9)
+MERGE_KERNEL(0xB)
+MERGE_KERNEL(0xD)
+MERGE_KERNEL(0xE)
+
+// The kernel for each operator.
+// (Operators that do not depend on both pixels need no merging.)
+static const MergeKernel merge_kernel[16] = {
+    [BOOL_NOR] = MergeRLERows0x1,    [BOOL_NOTAND] = MergeRLERows0x2,
+    [BOOL_ANDNOT] = MergeRLERows0x4, [BOOL_XOR] = MergeRLERows0x6,
+    [BOOL_NAND] = MergeRLERows0x7,   [BOOL_AND] = MergeRLERows0x8,
+    [BOOL_XNOR] = MergeRLERows0x9,   [BOOL_IMPLIES] = MergeRLERows0xB,
+    [BOOL_ORNOT] = MergeRLERows0xD,  [BOOL_OR] = MergeRLERows0xE,
+};
 
-  // 1ªOpção (Mais eficiente?
-  for (uint32 h=0; h<height; h++) {
-    int col=0;
-    do {
-      if (img1->row[h][col] != img2->row[h][col]) {
-        return 0;
-      }
-      col++;
-    } while (img1->row[h][col] != -1);
-  }
-
-  // 2ªOpção?
-  // int numRuns, size;
-  // for (uint32 h=0; h<img1->height; h++) {
-  //   size = GetSizeRLERowArray(img1->row[h]);
-  //   for (uint32 col=0; col<size; col++) {  
-  //     if (img1->row[h][col] != img2->row[h][col]) {
-  //       return 0;
-  //     }
-  //   }
-  // }
-  return 1; //As imagens são iguais
+// Boolean operations on bitmaps
+//
+// The truth table op gives four masks (all ones or all zeros), one for each
+// pair of pixel values, and each bit of the result is
+//   (a & b & m11) | (a & ~b & m10) | (~a & b & m01) | (~a & ~b & m00).
+// This is computed on whole vectors of 256 bits (AVX2) or 128 bits (SSE2),
+// when available, or on 64-bit words.
+
+#define BOOLOP_MASK(op, p1, p2) (-(uint64)BOOLOP_VALUE(op, p1, p2))
+
+/// Apply operator op to bitmaps a and b, of size bytes (multiple of 8)
+static void BitmapOpScalar(uint8 op, const uint8* a, const uint8* b,
+                           uint8* out, uint32 size) {
+  uint64 m11 = BOOLOP_MASK(op, 1, 1);
+  uint64 m10 = BOOLOP_MASK(op, 1, 0);
+  uint64 m01 = BOOLOP_MASK(op, 0, 1);
+  uint64 m00 = BOOLOP_MASK(op, 0, 0);
+  for (uint32 i = 0; i < size; i += 8) {
+    uint64 x, y;
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    uint64 z = (x & y & m11) | (x & ~y & m10) | (~x & y & m01) | (~(x | y) & m00);
+    memcpy(out + i, &z, 8);
+  }
 }
 
-int ImageIsDifferent(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
-  return !ImageIsEqual(img1, img2);
+#ifdef BITMAP_SIMD
+static void BitmapOpSSE2(uint8 op, const uint8* a, const uint8* b,
+                         uint8* out, uint32 size) {
+  __m128i m11 = _mm_set1_epi64x((long long)BOOLOP_MASK(op, 1, 1));
+  __m128i m10 = _mm_set1_epi64x((long long)BOOLOP_MASK(op, 1, 0));
+  __m128i m01 = _mm_set1_epi64x((long long)BOOLOP_MASK(op, 0, 1));
+  __m128i m00 = _mm_set1_epi64x((long long)BOOLOP_MASK(op, 0, 0));
+  uint32 i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    __m128i z = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(_mm_and_si128(x, y), m11),
+                     _mm_and_si128(_mm_andnot_si128(y, x), m10)),
+        _mm_or_si128(_mm_and_si128(_mm_andnot_si128(x, y), m01),
+                     _mm_andnot_si128(_mm_or_si128(x, y), m00)));
+    _mm_storeu_si128((__m128i*)(out + i), z);
+  }
+  if (i < size) BitmapOpScalar(op, a + i, b + i, out + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static void BitmapOpAVX2(uint8 op, const uint8* a, const uint8* b,
+                         uint8* out, uint32 size) {
+  __m256i m11 = _mm256_set1_epi64x((long long)BOOLOP_MASK(op, 1, 1));
+  __m256i m10 = _mm256_set1_epi64x((long long)BOOLOP_MASK(op, 1, 0));
+  __m256i m01 = _mm256_set1_epi64x((long long)BOOLOP_MASK(op, 0, 1));
+  __m256i m00 = _mm256_set1_epi64x((long long)BOOLOP_MASK(op, 0, 0));
+  uint32 i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+    __m256i z = _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(_mm256_and_si256(x, y), m11),
+                        _mm256_and_si256(_mm256_andnot_si256(y, x), m10)),
+        _mm256_or_si256(_mm256_and_si256(_mm256_andnot_si256(x, y), m01),
+                        _mm256_andnot_si256(_mm256_or_si256(x, y), m00)));
+    _mm256_storeu_si256((__m256i*)(out + i), z);
+  }
+  if (i < size) BitmapOpScalar(op, a + i, b + i, out + i, size - i);
+}
+#endif
+
+/// Apply operator op to bitmaps a and b, of size bytes (multiple of 8),
+/// with the widest vectors the processor supports
+static void BitmapOp(uint8 op, const uint8* a, const uint8* b, uint8* out,
+                     uint32 size) {
+#ifdef BITMAP_SIMD
+  if (have_avx2) {
+    BitmapOpAVX2(op, a, b, out, size);
+  } else {
+    BitmapOpSSE2(op, a, b, out, size);
+  }
+#else
+  BitmapOpScalar(op, a, b, out, size);
+#endif
 }
 
 /// Boolean Operations on image pixels
@@ -555,245 +3106,556 @@ Image ImageNEG(const Image img) {
   uint32 width = img->width;
   uint32 height = img->height;
 
-  Image newImage = AllocateImageHeader(width, height);
+  // As runs não mudam: são partilhadas com img
+  Image newImage = AllocateImageHeader(width, height, 0);
+  ShareArena(newImage, img);
 
   for (uint32 i = 0; i < height; i++) {
-    uint32 num_elems = GetSizeRLERowArray(img->row[i]);
-    newImage->row[i] = AllocateRLERowArray(num_elems);
-    memcpy(newImage->row[i], img->row[i], num_elems * sizeof(int));
-    newImage->row[i][0] ^= 1; // negação do primeiro elemento (com xor, 1 xor 1 = 0, 0 xor 1 = 1)
+    newImage->row[i] = img->row[i];
+    newImage->row[i].color ^= 1; // negação do primeiro pixel (com xor, 1 xor 1 = 0, 0 xor 1 = 1)
   }
 
+  // Os pixels pretos passam a ser os brancos
+  uint32* row_black = CopyCounts(img);
+  if (row_black != NULL) {
+    for (uint32 i = 0; i < height; i++) row_black[i] = width - row_black[i];
+  }
+  SetCounts(newImage, row_black);
+
+  return newImage;
+}
+
+/// Apply any boolean operator to the pixels of two images.
+///   op : the operator, given by its truth table (see BoolOp).
+Image ImageBoolOp(const Image img1, const Image img2, BoolOp op) {
+  assert(img1 != NULL && img2 != NULL);
+  check((img1->height == img2->height) && (img1->width == img2->width), "As imagens têm tamanhos diferentes!\n");
+
+  Image newImage = AllocateImageHeader(img1->width, img1->height, 0);
+  ImageBoolOpInto(newImage, img1, img2, op);
   return newImage;
 }
 
-// Função AND - 1ª Implementação (Não Otimizada)
-// Image ImageAND(const Image img1, const Image img2) {
-//   assert(img1 != NULL && img2 != NULL);
+Image ImageAND(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  return ImageBoolOp(img1, img2, BOOL_AND);
+}
+
+Image ImageOR(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  return ImageBoolOp(img1, img2, BOOL_OR);
+}
 
-//   // COMPLETE THE CODE
-//   // You might consider using the UncompressRow and CompressRow auxiliary files
-//   // Or devise a more efficient alternative
-//   // ...
-//   check((img1->height == img2->height) && (img1->width == img2->width), "As imagens têm tamanhos diferentes!\n");
+Image ImageXOR(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  return ImageBoolOp(img1, img2, BOOL_XOR);
+}
 
-//   Image newImage = ImageCreate(img1->width, img1->height, WHITE);
+/// Boolean Operations into an existing image
 
-//   for (uint32 i=0; i<img1->height; i++) {
-//     uint8 *row1 = UncompressRow(img1->width, img1->row[i]);
-//     uint8 *row2 = UncompressRow(img2->width, img2->row[i]);
-//     uint8 *newImageRow = UncompressRow(newImage->width, newImage->row[i]);
+/// These functions store the result of a boolean operation in an existing
+/// image dst, of the same size as the operands, replacing its pixels.
+/// The destination may be one of the operands.
+///
+/// The storage of dst is reused: its row table is overwritten, and
+/// the arena block of its old rows, once free, holds the next result.
+/// So a pipeline that keeps applying operations into the same images
+/// reaches a steady state without allocating memory.
+
+/// Negate the pixels of img.
+/// Only the color of the first pixel of each row changes.
+void ImageNEGInPlace(Image img) {
+  assert(img != NULL);
 
-//     for (uint32 j=0; j<img1->width; j++) {
-//       // Se algum dos pixels for preto
-//       if (row1[j] && row2[j]) {
-//         newImageRow[j] = 1;
-//       }
-//     }
-//     newImage->row[i] = CompressRow(newImage->width, newImageRow);
-//   }
-//   return newImage;
-// }
+  for (uint32 i = 0; i < img->height; i++) {
+    img->row[i].color ^= 1;
+  }
 
-// Função AND - 2ª Implementação (Otimizada)
-Image ImageAND(const Image img1, const Image img2) {
-    assert(img1 != NULL && img2 != NULL);
-
-    // COMPLETE THE CODE
-    // You might consider using the UncompressRow and CompressRow auxiliary files
-    // Or devise a more efficient alternative
-    // ...
-
-    check((img1->height == img2->height) && (img1->width == img2->width), "As imagens têm tamanhos diferentes!\n");
-
-    Image newImage = AllocateImageHeader(img1->width, img1->height);
-
-    for (uint32 h = 0; h < img1->height; h++) {
-        int r1 = GetNumRunsInRLERow(img1->row[h]);
-        int r2 = GetNumRunsInRLERow(img2->row[h]);
-
-        int cr1 = 1; // current run (valor) [começamos em 1]
-        int cr2 = 1; // current run (valor) [começamos em 1]
-
-        int cb1 = img1->row[h][0]; // current bit (cor)
-        int cb2 = img2->row[h][0]; // current bit (cor)
-
-        int val1 = img1->row[h][cr1]; // pixels restantes da run
-        int val2 = img2->row[h][cr2]; // pixels restantes da run
-
-        int n = 1;
-        
-        // Como não sabemos exatamente o tamanho da row, alocamos r1+r2+2
-        // para garantir que não perdemos nenhum valor
-        // no fim da row alocaremos a memória estritamente necessária
-        // através do contador/index n
-        newImage->row[h] = calloc((r1 + r2 + 2), sizeof(int));
-        newImage->row[h][0] = cb1 && cb2;
-
-        while (cr1 <= r1 && cr2 <= r2) {
-            int cb = cb1 && cb2;  // color bit (da comparação atual)
-            
-            if (val1 > val2) {
-                newImage->row[h][n] += val2;
-                val1 -= val2;
-                val2 = img2->row[h][++cr2];
-                cb2 ^= 1;
-            } else if (val1 < val2) {
-                newImage->row[h][n] += val1;
-                val2 -= val1;
-                val1 = img1->row[h][++cr1];
-                cb1 ^= 1;
-            } else {
-                newImage->row[h][n] += val1;
-                val1 = img1->row[h][++cr1];
-                val2 = img2->row[h][++cr2];
-                cb1 ^= 1;
-                cb2 ^= 1;
-            }
-            
-            if (cb != (cb1 && cb2)) { // não trocamos de run se a próxima cor não for diferente
-                n++;
-            }
-        }
-        
-        newImage->row[h][n+1] = EOR;
-        newImage->row[h] = realloc(newImage->row[h], (n + 2) * sizeof(int));
+  // (Negating a row complements its hash)
+  if (img->row_hash != NULL) {
+    for (uint32 i = 0; i < img->height; i++) {
+      img->row_hash[i] = ~img->row_hash[i];
     }
-    return newImage;
+    img->hash = CombineRowHashes(img->width, img->height, img->row_hash);
+  }
+  if (img->row_black != NULL) {
+    for (uint32 i = 0; i < img->height; i++) {
+      img->row_black[i] = img->width - img->row_black[i];
+    }
+    img->black = (uint64)img->width * img->height - img->black;
+  }
 }
 
-Image ImageOR(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
+/// Make dst a copy of src, sharing its rows, negated if neg is 1.
+static void ShareRowsInto(Image dst, const Image src, uint8 neg) {
+  if (dst != src) {
+    // The old rows are not needed: src holds its own references
+    ReleaseArena(dst, dst->num_arenas);
+    dst->fill = NULL;
+    dst->garbage = 0;
+    ClearRowDict(dst);
+    ForgetRowCaches(dst);
+    ShareArena(dst, src);
+    memcpy(dst->row, src->row, src->height * sizeof(RowRef));
+    SetCounts(dst, CopyCounts(src));
+  }
+  if (neg) ImageNEGInPlace(dst);
+}
 
-  // COMPLETE THE CODE
-  // You might consider using the UncompressRow and CompressRow auxiliary files
-  // Or devise a more efficient alternative
-  // ...
-    check((img1->height == img2->height) && (img1->width == img2->width), "As imagens têm tamanhos diferentes!\n");
-
-    Image newImage = AllocateImageHeader(img1->width, img1->height);
-
-    for (uint32 h = 0; h < img1->height; h++) {
-        int r1 = GetNumRunsInRLERow(img1->row[h]);
-        int r2 = GetNumRunsInRLERow(img2->row[h]);
-
-        int cr1 = 1; // current run (valor) [começamos em 1]
-        int cr2 = 1; // current run (valor) [começamos em 1]
-
-        int cb1 = img1->row[h][0]; // current bit (cor)
-        int cb2 = img2->row[h][0]; // current bit (cor)
-
-        int val1 = img1->row[h][cr1]; // pixels restantes da run
-        int val2 = img2->row[h][cr2]; // pixels restantes da run
-
-        int n = 1;
-        
-        // Como não sabemos exatamente o tamanho da row, alocamos r1+r2+2
-        // para garantir que não perdemos nenhum valor
-        // no fim da row realocaremos a memória estritamente necessária
-        // através do contador/index n
-        newImage->row[h] = calloc((r1 + r2 + 2), sizeof(int));
-        newImage->row[h][0] = cb1 || cb2;
-
-        while (cr1 <= r1 && cr2 <= r2) {
-            int cb = cb1 || cb2;  // color bit (da comparação atual)
-
-            if (val1 > val2) {
-                newImage->row[h][n] += val2;
-                val1 -= val2;
-                val2 = img2->row[h][++cr2];
-                cb2 ^= 1;
-            } else if (val1 < val2) {
-                newImage->row[h][n] += val1;
-                val2 -= val1;
-                val1 = img1->row[h][++cr1];
-                cb1 ^= 1;
-            } else {
-                newImage->row[h][n] += val1;
-                val1 = img1->row[h][++cr1];
-                val2 = img2->row[h][++cr2];
-                cb1 ^= 1;
-                cb2 ^= 1;
-            }
-
-            if (cb != (cb1 || cb2)) { // não trocamos de run se a próxima cor não for diferente
-                n++;
-                newImage->row[h][n] = 0;
-            }
-        }
+void ImageNEGInto(Image dst, const Image img) {
+  assert(dst != NULL && img != NULL);
+  check((dst->height == img->height) && (dst->width == img->width), "As imagens têm tamanhos diferentes!\n");
+
+  ShareRowsInto(dst, img, 1);
+}
+
+typedef struct {
+  Image* store;  // the row store of each worker
+  Image dst;
+  Image img1;
+  Image img2;
+  MergeKernel merge;
+  uint8 op;
+} MergeJob;
+
+static uint32 MergeCost(void* ctx, uint32 h) {
+  MergeJob* job = ctx;
+  return GetNumRunsInRLERow(job->img1->row[h].rle) +
+         GetNumRunsInRLERow(job->img2->row[h].rle);
+}
 
-        newImage->row[h][n+1] = EOR;
-        newImage->row[h] = realloc(newImage->row[h], (n + 2) * sizeof(int));
+static void MergeRows(void* ctx, uint32 worker, uint32 first, uint32 last) {
+  MergeJob* job = ctx;
+  Image dst = job->dst;
+
+  // The runs of each new row are assembled in a buffer (at most width runs)
+  // and then stored in the arena, with their exact size.
+  // (Row h of the operands is read before row h of dst is written,
+  // so dst may be one of the operands.)
+  uint32 width = dst->width;
+  uint32* runs = AllocateRunsBuffer(width);
+  uint32 size = BitmapSize(width);
+  uint8* bits = NULL;  // room for 3 bitmaps (allocated when first needed)
+  for (uint32 h = first; h < last; h++) {
+    RowRef row1 = job->img1->row[h];
+    RowRef row2 = job->img2->row[h];
+    if (row1.rle->enc == BITMAP || row2.rle->enc == BITMAP) {
+      // Dense rows: operate on the pixels, many at a time
+      if (bits == NULL) {
+        bits = malloc(3 * (size_t)size);
+        check(bits != NULL, "malloc");
+      }
+      ExpandRow(row1, width, bits);
+      ExpandRow(row2, width, bits + size);
+      BitmapOp(job->op, bits, bits + size, bits + 2 * size, size);
+      dst->row_black[h] = CountBits(bits + 2 * size, width);
+      dst->row[h] = StoreBitmapRow(job->store[worker], bits + 2 * size,
+                                   width, runs);
+    } else {
+      uint8 color;
+      uint32 n = job->merge(width, row1, row2, runs, &color);
+      dst->row_black[h] = CountBlackRuns(runs, n, color);
+      dst->row[h].rle = StoreRLERow(job->store[worker], runs, n);
+      dst->row[h].color = color;
     }
+  }
+  free(bits);
+  free(runs);
+}
 
-    return newImage;
+/// Apply any boolean operator op to the pixels of img1 and img2,
+/// storing the result in dst.
+void ImageBoolOpInto(Image dst, const Image img1, const Image img2, BoolOp op) {
+  assert(dst != NULL && img1 != NULL && img2 != NULL);
+  assert(op <= BOOL_TRUE);
+  check((img1->height == img2->height) && (img1->width == img2->width), "As imagens têm tamanhos diferentes!\n");
+  check((dst->height == img1->height) && (dst->width == img1->width), "As imagens têm tamanhos diferentes!\n");
+
+  // Operators that ignore (at least) one of the images
+  switch (op) {
+    case BOOL_FIRST:
+      ShareRowsInto(dst, img1, 0);
+      return;
+    case BOOL_NOT1:
+      ShareRowsInto(dst, img1, 1);
+      return;
+    case BOOL_SECOND:
+      ShareRowsInto(dst, img2, 0);
+      return;
+    case BOOL_NOT2:
+      ShareRowsInto(dst, img2, 1);
+      return;
+    default:
+      break;
+  }
+
+  if (op == BOOL_FALSE || op == BOOL_TRUE) {
+    // All rows are equal (as in ImageCreate)
+    uint32 num_old = RestartArena(dst, sizeof(RowHeader) + 8);
+    uint32 run = dst->width;
+    dst->row[0].rle = StoreRLERow(dst, &run, 1);
+    dst->row[0].color = op == BOOL_TRUE ? BLACK : WHITE;
+    uint32* row_black = NewCounts(dst->height);
+    row_black[0] = op == BOOL_TRUE ? dst->width : 0;
+    for (uint32 h = 1; h < dst->height; h++) {
+      dst->row[h] = dst->row[0];
+      row_black[h] = row_black[0];
+    }
+    SetCounts(dst, row_black);
+    ReleaseArena(dst, num_old);
+    return;
+  }
+
+  MergeKernel merge = merge_kernel[op];
+  assert(merge != NULL);
+
+  // (The arenas of the operands, together, are a good estimate
+  // of the size of the result)
+  uint32 threads = ThreadsFor(dst->height);
+  size_t capacity = (ArenaUsed(img1) + ArenaUsed(img2)) / threads;
+  uint32 num_old = RestartArena(dst, capacity);
+
+  // (The workers count the BLACK pixels of each new row, too)
+  dst->row_black = NewCounts(dst->height);
+  MergeJob job = {BeginRowStores(dst, threads, capacity), dst, img1, img2,
+                  merge, op};
+  ParallelRows(threads, dst->height, MergeRows, MergeCost, &job);
+  EndRowStores(dst, job.store, threads);
+  SetCounts(dst, dst->row_black);
+
+  ReleaseArena(dst, num_old);
 }
 
-Image ImageXOR(Image img1, Image img2) {
-  assert(img1 != NULL && img2 != NULL);
+void ImageANDInto(Image dst, const Image img1, const Image img2) {
+  ImageBoolOpInto(dst, img1, img2, BOOL_AND);
+}
 
-  // COMPLETE THE CODE
-  // You might consider using the UncompressRow and CompressRow auxiliary files
-  // Or devise a more efficient alternative
-  // ...
-    check((img1->height == img2->height) && (img1->width == img2->width), "As imagens têm tamanhos diferentes!\n");
-
-    Image newImage = AllocateImageHeader(img1->width, img1->height);
-
-    for (uint32 h = 0; h < img1->height; h++) {
-        int r1 = GetNumRunsInRLERow(img1->row[h]);
-        int r2 = GetNumRunsInRLERow(img2->row[h]);
-
-        int cr1 = 1; // current run (valor) [começamos em 1]
-        int cr2 = 1; // current run (valor) [começamos em 1]
-
-        int cb1 = img1->row[h][0]; // current bit (cor)
-        int cb2 = img2->row[h][0]; // current bit (cor)
-
-        int val1 = img1->row[h][cr1]; // pixels restantes da run
-        int val2 = img2->row[h][cr2]; // pixels restantes da run
-
-        int n = 1;
-        
-        // Como não sabemos exatamente o tamanho da row, alocamos r1+r2+2
-        // para garantir que não perdemos nenhum valor
-        // no fim da row alocaremos a memória estritamente necessária
-        // através do contador/index n
-        newImage->row[h] = calloc((r1 + r2 + 2), sizeof(int));
-        newImage->row[h][0] = cb1 != cb2;
-
-        while (cr1 <= r1 && cr2 <= r2) {
-            int cb = cb1 != cb2;  // color bit (da comparação atual)
-
-            if (val1 > val2) {
-                newImage->row[h][n] += val2;
-                val1 -= val2;
-                val2 = img2->row[h][++cr2];
-                cb2 ^= 1;
-            } else if (val1 < val2) {
-                newImage->row[h][n] += val1;
-                val2 -= val1;
-                val1 = img1->row[h][++cr1];
-                cb1 ^= 1;
-            } else {
-                newImage->row[h][n] += val1;
-                val1 = img1->row[h][++cr1];
-                val2 = img2->row[h][++cr2];
-                cb1 ^= 1;
-                cb2 ^= 1;
-            }
-
-            if (cb != (cb1 != cb2)) { // não trocamos de run se a próxima cor não for diferente
-                n++;
-                newImage->row[h][n] = 0;
-            }
-        }
+void ImageORInto(Image dst, const Image img1, const Image img2) {
+  ImageBoolOpInto(dst, img1, img2, BOOL_OR);
+}
+
+void ImageXORInto(Image dst, const Image img1, const Image img2) {
+  ImageBoolOpInto(dst, img1, img2, BOOL_XOR);
+}
+
+/// Paste src into dst at (x, y), combining their pixels with operator op.
+/// (Rows are spliced as in the pixel editing functions: each row of dst
+/// covered by src is sliced around the window, the window is merged with
+/// the row of src, and the three parts are joined.)
+void ImagePasteOp(Image dst, const Image src, uint32 x, uint32 y,
+                  BoolOp op) {  ///
+  assert(dst != NULL && src != NULL);
+  assert(op <= BOOL_TRUE);
+  assert(x <= dst->width && y <= dst->height);
+
+  // The part of src inside dst
+  uint32 width = src->width < dst->width - x ? src->width : dst->width - x;
+  uint32 height =
+      src->height < dst->height - y ? src->height : dst->height - y;
+  if (width == 0 || height == 0 || op == BOOL_FIRST) return;
+
+  // (The rows of src must not change while they are pasted)
+  Image copy = src == dst ? ImageClone(src) : NULL;
+  const Image from = copy != NULL ? copy : src;
+  MergeKernel merge = merge_kernel[op];
+
+  uint32* out = AllocateRunsBuffer(dst->width);
+  uint32* part = AllocateRunsBuffer(dst->width);
+  uint32* ends = AllocateRunsBuffer(dst->width);
+  uint32* mid = AllocateRunsBuffer(width);
+  ScratchRow* window = AllocateScratchRow(width);
+  ScratchRow* stamp = AllocateScratchRow(width);
+
+  RowRef prev_old = {NULL, 0};
+  RowRef prev_src = {NULL, 0};
+  RowRef prev_new = {NULL, 0};
+  uint32 prev_black = 0;
+  for (uint32 h = 0; h < height; h++) {
+    RowRef old = dst->row[y + h];
+    RowRef row = from->row[h];
+    if (h > 0 && old.rle == prev_old.rle && old.color == prev_old.color &&
+        row.rle == prev_src.rle && row.color == prev_src.color) {
+      // (Equal rows pasted on equal rows give equal rows)
+      if (prev_new.rle != old.rle || prev_new.color != old.color) {
+        ReplaceRow(dst, y + h, prev_new, prev_black);
+      }
+      continue;
+    }
+    prev_old = old;
+    prev_src = row;
+    prev_new = old;
+
+    // The run ends of the row of dst, to slice it three times
+    const uint32* old_ends = KnownRunEnds(dst, y + h);
+    if (old_ends == NULL && old.rle->enc != BITMAP) {
+      RunReader reader = ReadRuns(old.rle, dst->width);
+      uint32 end = 0;
+      for (uint32 i = 0; i < old.rle->num_runs; i++) {
+        end += NextRun(&reader);
+        ends[i] = end;
+      }
+      old_ends = ends;
+    }
 
-        newImage->row[h][n+1] = EOR;
-        newImage->row[h] = realloc(newImage->row[h], (n + 2) * sizeof(int));
+    // The window of the row of dst, and the row of src, as scratch rows
+    uint8 wcolor, scolor;
+    uint32 wn = SliceRow(old, dst->width, old_ends, x, x + width,
+                         window->runs, &wcolor);
+    uint32 sn = SliceRow(row, from->width, KnownRunEnds(from, h), 0, width,
+                         stamp->runs, &scolor);
+
+    // The new pixels of the window
+    const uint32* mruns = mid;
+    uint8 mcolor;
+    uint32 mn;
+    if (merge != NULL) {
+      mn = merge(width, ScratchRef(window, wn, wcolor),
+                 ScratchRef(stamp, sn, scolor), mid, &mcolor);
+    } else if (op == BOOL_FALSE || op == BOOL_TRUE) {
+      mid[0] = width;
+      mn = 1;
+      mcolor = op == BOOL_TRUE ? BLACK : WHITE;
+    } else if (op == BOOL_NOT1) {
+      mruns = window->runs;
+      mn = wn;
+      mcolor = wcolor ^ 1;
+    } else {
+      mruns = stamp->runs;
+      mn = sn;
+      mcolor = op == BOOL_NOT2 ? scolor ^ 1 : scolor;
+    }
+    if (mn == wn && mcolor == wcolor &&
+        memcmp(mruns, window->runs, mn * sizeof(uint32)) == 0) {
+      continue;  // (the window does not change)
     }
 
-    return newImage;
+    // Join the parts of the row
+    RunWriter w = {out, 0, 0, 0};
+    uint8 color;
+    uint32 n = x > 0 ? SliceRow(old, dst->width, old_ends, 0, x, part,
+                                &color)
+                     : 0;
+    for (uint32 i = 0; i < n; i++, color ^= 1) EmitRun(&w, part[i], color);
+    color = mcolor;
+    for (uint32 i = 0; i < mn; i++, color ^= 1) EmitRun(&w, mruns[i], color);
+    n = x + width < dst->width ? SliceRow(old, dst->width, old_ends,
+                                          x + width, dst->width, part, &color)
+                               : 0;
+    for (uint32 i = 0; i < n; i++, color ^= 1) EmitRun(&w, part[i], color);
+
+    prev_new.rle = StoreRLERow(dst, out, w.n);
+    prev_new.color = w.first;
+    prev_black = CountBlackRuns(out, w.n, w.first);
+    ReplaceRow(dst, y + h, prev_new, prev_black);
+  }
+
+  free(stamp);
+  free(window);
+  free(mid);
+  free(ends);
+  free(part);
+  free(out);
+  ImageDestroy(&copy);
+  CollectGarbage(dst);
+}
+
+void ImagePaste(Image dst, const Image src, uint32 x, uint32 y) {  ///
+  ImagePasteOp(dst, src, x, y, BOOL_SECOND);
+}
+
+/// Boolean reductions of many images
+
+/// These functions apply an associative boolean operation to k images
+/// of the same size, img[0] op img[1] op ... op img[k-1],
+/// or any boolean function given by its truth table (for a few images),
+/// returning a new image as a result.
+///
+/// All the rows h of the images are merged in a single pass: a cursor on
+/// each of them gives the position of its next run boundary, and a heap of
+/// the cursors, ordered by that position, yields the boundaries from left
+/// to right. The value of a reduction only depends on how many of the k
+/// pixels are black, and that of a function on which of them are black,
+/// so it is updated at each boundary in constant time.
+/// This takes O(R log k) time, for R runs in the k rows.
+///
+/// Requires: k >= 1.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// Restore the heap property of heap[0..n-1], keyed by pos,
+/// when the key of heap[i] may have increased.
+static void SiftDownCursor(uint32* heap, uint32 n, const uint32* pos,
+                           uint32 i) {
+  uint32 c = heap[i];
+  for (;;) {
+    uint32 child = 2 * i + 1;
+    if (child >= n) break;
+    if (child + 1 < n && pos[heap[child + 1]] < pos[heap[child]]) child++;
+    if (pos[heap[child]] >= pos[c]) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = c;
+}
+
+/// Value of the function of k pixels computed by SweepImages:
+/// the pixels are given by mask (bit i is the pixel of image i), which is
+/// only kept for a table, and by the number nblack of black pixels.
+static inline uint8 SweepValue(BoolOp op, const uint8* table, uint32 mask,
+                               uint32 nblack, uint32 k) {
+  if (table != NULL) return table[mask];
+  switch (op) {
+    case BOOL_AND:
+      return nblack == k;
+    case BOOL_OR:
+      return nblack > 0;
+    default:
+      return nblack & 1;
+  }
+}
+
+typedef struct {
+  Image* store;  // the row store of each worker
+  Image dst;
+  const Image* img;
+  uint32 k;
+  BoolOp op;
+  const uint8* table;
+} SweepJob;
+
+static uint32 SweepCost(void* ctx, uint32 h) {
+  SweepJob* job = ctx;
+  uint32 cost = 0;
+  for (uint32 c = 0; c < job->k; c++) {
+    cost += GetNumRunsInRLERow(job->img[c]->row[h].rle);
+  }
+  return cost;
+}
+
+static void SweepRows(void* ctx, uint32 worker, uint32 first, uint32 last) {
+  SweepJob* job = ctx;
+  const Image* img = job->img;
+  uint32 k = job->k;
+  BoolOp op = job->op;
+  const uint8* table = job->table;
+  Image newImage = job->dst;
+  uint32 width = newImage->width;
+
+  // The cursors: for cursor c, on row h of img[c],
+  // pos[c] is the position of its next run boundary and color[c] is the
+  // color of the pixels up to there
+  RunReader* reader = malloc(k * sizeof(RunReader));
+  uint32* pos = malloc(k * sizeof(uint32));
+  uint8* color = malloc(k * sizeof(uint8));
+  uint32* heap = malloc(k * sizeof(uint32));
+  check(reader != NULL && pos != NULL && color != NULL && heap != NULL, "malloc");
+  uint32* runs = AllocateRunsBuffer(width);
+
+  for (uint32 h = first; h < last; h++) {
+    uint32 nblack = 0;  // number of cursors on black pixels
+    uint32 mask = 0;    // which cursors are on black pixels (for a table)
+    for (uint32 c = 0; c < k; c++) {
+      reader[c] = ReadRuns(img[c]->row[h].rle, width);
+      pos[c] = NextRun(&reader[c]);
+      color[c] = img[c]->row[h].color;
+      nblack += color[c];
+      if (table != NULL) mask |= (uint32)color[c] << c;
+      heap[c] = c;
+    }
+    for (uint32 i = k / 2; i-- > 0;) {
+      SiftDownCursor(heap, k, pos, i);
+    }
+
+    uint8 cur = SweepValue(op, table, mask, nblack, k);  // value of the current output run
+    uint32 start = 0;  // where it started
+    uint32 n = 0;      // output runs completed
+    newImage->row[h].color = cur;
+
+    // (All rows end at width, the last boundary of every cursor)
+    while (pos[heap[0]] < width) {
+      uint32 x = pos[heap[0]];
+      do {
+        uint32 c = heap[0];
+        color[c] ^= 1;
+        if (color[c]) nblack++;
+        else nblack--;
+        if (table != NULL) mask ^= (uint32)1 << c;
+        pos[c] += NextRun(&reader[c]);
+        SiftDownCursor(heap, k, pos, 0);
+      } while (pos[heap[0]] == x);
+
+      if (SweepValue(op, table, mask, nblack, k) != cur) {
+        runs[n++] = x - start;
+        start = x;
+        cur ^= 1;
+      }
+    }
+    runs[n++] = width - start;
+
+    newImage->row[h].rle = StoreRLERow(job->store[worker], runs, n);
+  }
+
+  free(runs);
+  free(heap);
+  free(color);
+  free(pos);
+  free(reader);
+}
+
+/// Compute a function of the pixels of k images, in a single pass.
+/// The function is given by a truth table (if table is not NULL),
+/// or it is the reduction by op (BOOL_AND, BOOL_OR or BOOL_XOR).
+static Image SweepImages(const Image img[], uint32 k, BoolOp op,
+                         const uint8* table) {
+  assert(img != NULL && k >= 1);
+  assert(table != NULL || op == BOOL_AND || op == BOOL_OR || op == BOOL_XOR);
+  assert(table == NULL || k <= 32);
+
+  uint32 width = img[0]->width;
+  uint32 height = img[0]->height;
+  size_t capacity = 0;
+  for (uint32 i = 0; i < k; i++) {
+    assert(img[i] != NULL);
+    check((img[i]->height == height) && (img[i]->width == width), "As imagens têm tamanhos diferentes!\n");
+    capacity += ArenaUsed(img[i]);
+  }
+
+  // (The result has at most as many runs as all the images together,
+  // so a single block, split among the threads, is about enough)
+  uint32 threads = ThreadsFor(height);
+  capacity /= threads;
+  Image newImage = AllocateImageHeader(width, height, capacity);
+
+  SweepJob job = {BeginRowStores(newImage, threads, capacity), newImage,
+                  img, k, op, table};
+  ParallelRows(threads, height, SweepRows, SweepCost, &job);
+  EndRowStores(newImage, job.store, threads);
+
+  return newImage;
+}
+
+Image ImageReduceAND(const Image img[], uint32 k) {
+  return SweepImages(img, k, BOOL_AND, NULL);
+}
+
+Image ImageReduceOR(const Image img[], uint32 k) {
+  return SweepImages(img, k, BOOL_OR, NULL);
+}
+
+Image ImageReduceXOR(const Image img[], uint32 k) {
+  return SweepImages(img, k, BOOL_XOR, NULL);
+}
+
+/// Apply any boolean function of k pixels to k images, in a single pass.
+///   table : the truth table, with 2^k entries (0 or 1);
+///           entry m is the value for the pixels given by the bits of m
+///           (bit i is the pixel of img[i]).
+/// Requires: 1 <= k <= IMAGE_BOOLFUNC_MAX.
+Image ImageBoolFunc(const Image img[], uint32 k, const uint8 table[]) {
+  assert(table != NULL);
+  assert(k >= 1 && k <= IMAGE_BOOLFUNC_MAX);
+  return SweepImages(img, k, BOOL_FALSE, table);
 }
 
 /// Geometric transformations
@@ -816,17 +3678,88 @@ Image ImageHorizontalMirror(const Image img) {
   uint32 width = img->width;
   uint32 height = img->height;
 
-  Image newImage = AllocateImageHeader(width, height);
+  // As rows são partilhadas com img, apenas por outra ordem
+  Image newImage = AllocateImageHeader(width, height, 0);
+  ShareArena(newImage, img);
 
   for (uint32  h=0; h<height; h++) {
-    int row_size = GetSizeRLERowArray(img->row[height-h-1]);
-    newImage->row[h] = AllocateRLERowArray(row_size);
-    memcpy(newImage->row[h], img->row[height-h-1], row_size * sizeof(int));
+    newImage->row[h] = img->row[height-h-1];
+  }
+
+  if (img->row_black != NULL) {
+    uint32* row_black = NewCounts(height);
+    for (uint32 h=0; h<height; h++) {
+      row_black[h] = img->row_black[height-h-1];
+    }
+    SetCounts(newImage, row_black);
   }
 
   return newImage;
 }
 
+typedef struct {
+  Image* store;  // the row store of each worker
+  Image dst;
+  Image img;
+} MirrorJob;
+
+static uint32 MirrorCost(void* ctx, uint32 h) {
+  MirrorJob* job = ctx;
+  return job->img->row[h].rle->size;
+}
+
+static void MirrorRows(void* ctx, uint32 worker, uint32 first, uint32 last) {
+  MirrorJob* job = ctx;
+  Image img = job->img;
+  Image newImage = job->dst;
+  Image store = job->store[worker];
+
+  for (uint32 h=first; h<last; h++) {
+    const RowHeader* row = img->row[h].rle;
+    uint32 n = GetNumRunsInRLERow(row);
+    int cb = img->row[h].color;  // color bit
+    cb = n%2==0 ? 1-cb:cb; // alteração de color bit caso o número de runs seja par (imagem espelhada começa com a cor oposta)
+
+    // As runs invertidas têm a mesma codificação (e o mesmo tamanho)
+    RowHeader* newRow = AllocateRLERow(store, row->size);
+    *newRow = *row;
+
+    const uint8* src = (const uint8*)(row + 1);
+    uint8* dst = (uint8*)(newRow + 1);
+    if (row->enc == RUN8) {
+      for (uint32 i=0; i<n; i++) {
+        dst[i] = src[n-1-i];
+      }
+    } else if (row->enc == RUN16) {
+      for (uint32 i=0; i<n; i++) {
+        memcpy(dst + 2*i, src + 2*(n-1-i), 2);
+      }
+    } else if (row->enc == BITMAP) {
+      // cada bit é copiado para a posição espelhada
+      // (e passa a ser relativo ao novo primeiro pixel, o último de row)
+      uint32 width = img->width;
+      uint8 flip = GetBit(src, width-1);
+      memset(dst, 0, row->size);
+      for (uint32 x=0; x<width; x++) {
+        if (GetBit(src, width-1-x) != flip) dst[x>>3] |= 0x80 >> (x&7);
+      }
+    } else {
+      // cada varint é copiado, inteiro, para a posição espelhada
+      const uint8* p = src;
+      uint8* q = dst + row->size;
+      while (p < src + row->size) {
+        uint32 len = 1;
+        while (p[len-1] & 0x80) len++;
+        q -= len;
+        memcpy(q, p, len);
+        p += len;
+      }
+    }
+    newImage->row[h].rle = intern_rows ? InternRLERow(store, newRow) : newRow;
+    newImage->row[h].color = cb;
+  }
+}
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -840,27 +3773,39 @@ Image ImageVerticalMirror(const Image img) {
   uint32 width = img->width;
   uint32 height = img->height;
 
-  Image newImage = AllocateImageHeader(width, height);
+  uint32 threads = ThreadsFor(height);
+  size_t capacity = ArenaUsed(img) / threads;
+  Image newImage = AllocateImageHeader(width, height, capacity);
 
   // COMPLETE THE CODE
-  int size;
-  for (uint32 h=0; h<height; h++) {
+  MirrorJob job = {BeginRowStores(newImage, threads, capacity), newImage, img};
+  ParallelRows(threads, height, MirrorRows, MirrorCost, &job);
+  EndRowStores(newImage, job.store, threads);
+
+  // (As linhas espelhadas têm os mesmos pixels pretos)
+  SetCounts(newImage, CopyCounts(img));
 
-    size = GetSizeRLERowArray(img->row[h]);
-    int cb = img->row[h][0];  // color bit
-    cb = size%2==0 ? 1-cb:cb; // alteração de color bit caso size seja par (imagem espelhada começa com a cor oposta)
-    
-    newImage->row[h] = AllocateRLERowArray(size);
-    newImage->row[h][0] = cb;
-    for (int i=1; i<size-1; i++) {
-      newImage->row[h][i] = img->row[h][size-1-i];
-    }
-    newImage->row[h][size-1] = EOR;
-  }
-  
   return newImage;
 }
-  
+
+void ImageVerticalMirrorInto(Image dst, const Image img) {  ///
+  assert(dst != NULL && img != NULL);
+  check((dst->height == img->height) && (dst->width == img->width), "As imagens têm tamanhos diferentes!\n");
+
+  // (Each row is read before its mirror is stored, so dst may be img)
+  uint32 threads = ThreadsFor(dst->height);
+  size_t capacity = ArenaUsed(img) / threads;
+  uint32* row_black = CopyCounts(img);  // (before dst forgets them)
+  uint32 num_old = RestartArena(dst, capacity);
+
+  MirrorJob job = {BeginRowStores(dst, threads, capacity), dst, img};
+  ParallelRows(threads, dst->height, MirrorRows, MirrorCost, &job);
+  EndRowStores(dst, job.store, threads);
+  SetCounts(dst, row_black);
+
+  ReleaseArena(dst, num_old);
+}
+
 /// Replicate img2 at the bottom of imag1, creating a larger image
 /// Requires: the width of the two images must be the same.
 /// Returns the new larger image.
@@ -875,24 +3820,89 @@ Image ImageReplicateAtBottom(const Image img1, const Image img2) {
   uint32 new_width = img1->width;
   uint32 new_height = img1->height + img2->height;
 
-  Image newImage = AllocateImageHeader(new_width, new_height);
+  // As rows são partilhadas com img1 e img2
+  Image newImage = AllocateImageHeader(new_width, new_height, 0);
+  ShareArena(newImage, img1);
+  ShareArena(newImage, img2);
 
   uint32 h1;
-  int size;
   for(h1=0; h1<img1->height; h1++) {
-    size = GetSizeRLERowArray(img1->row[h1]);
-    newImage->row[h1] = AllocateRLERowArray(size);
-    memcpy(newImage->row[h1], img1->row[h1], size * sizeof(int));
+    newImage->row[h1] = img1->row[h1];
   }
   for (uint32 h2=0; h2<img2->height; h2++) {
-    size = GetSizeRLERowArray(img2->row[h2]);
-    newImage->row[h1+h2] = AllocateRLERowArray(size);
-    memcpy(newImage->row[h1+h2], img2->row[h2], size * sizeof(int));
+    newImage->row[h1+h2] = img2->row[h2];
+  }
+
+  if (img1->row_black != NULL && img2->row_black != NULL) {
+    uint32* row_black = NewCounts(new_height);
+    memcpy(row_black, img1->row_black, img1->height * sizeof(uint32));
+    memcpy(row_black + img1->height, img2->row_black,
+           img2->height * sizeof(uint32));
+    SetCounts(newImage, row_black);
   }
 
   return newImage;
 }
 
+typedef struct {
+  Image* store;  // the row store of each worker
+  Image dst;
+  Image img1;
+  Image img2;
+} ReplicateJob;
+
+static uint32 ReplicateCost(void* ctx, uint32 h) {
+  ReplicateJob* job = ctx;
+  return GetNumRunsInRLERow(job->img1->row[h].rle) +
+         GetNumRunsInRLERow(job->img2->row[h].rle);
+}
+
+static void ReplicateRows(void* ctx, uint32 worker, uint32 first,
+                          uint32 last) {
+  ReplicateJob* job = ctx;
+  Image img1 = job->img1;
+  Image img2 = job->img2;
+  Image newImage = job->dst;
+
+  // As runs da nova row são montadas num buffer (no máximo, a largura da nova imagem)
+  // e só depois guardadas na arena, com a codificação mais compacta
+  uint32* runs = AllocateRunsBuffer(newImage->width);
+
+  for (uint32 h=first; h<last; h++) {
+    uint32 r1 = GetNumRunsInRLERow(img1->row[h].rle);
+    uint32 r2 = GetNumRunsInRLERow(img2->row[h].rle);
+
+    int isEven = r1%2==0 ? 1:0;
+    int sameColor = img1->row[h].color == img2->row[h].color ? 1:0;  // img1 e img2 começam na mesma cor
+
+    // a última run de img1 e a primeira de img2 juntam-se se tiverem a mesma cor
+    int join = (isEven && !sameColor) || (!isEven && sameColor);
+
+    RunReader rd1 = ReadRuns(img1->row[h].rle, img1->width);
+    RunReader rd2 = ReadRuns(img2->row[h].rle, img2->width);
+
+    uint32 w1;
+    for (w1=0; w1<r1; w1++) { // copia as runs de img1->row
+      runs[w1] = NextRun(&rd1);
+    }
+
+    uint32 w2 = 0;
+    if (join) {
+      runs[w1-1] += NextRun(&rd2);
+      w2++;
+    }
+
+    while(w2<r2) {
+      runs[w1++] = NextRun(&rd2);
+      w2++;
+    }
+
+    newImage->row[h].rle = StoreRLERow(job->store[worker], runs, w1);
+    newImage->row[h].color = img1->row[h].color;
+  }
+  free(runs);
+}
+
 /// Replicate img2 to the right of imag1, creating a larger image
 /// Requires: the height of the two images must be the same.
 /// Returns the new larger image.
@@ -907,37 +3917,401 @@ Image ImageReplicateAtRight(const Image img1, const Image img2) {
   uint32 new_width = img1->width + img2->width;
   uint32 new_height = img1->height;
 
-  Image newImage = AllocateImageHeader(new_width, new_height);
+  uint32 threads = ThreadsFor(new_height);
+  size_t capacity = (ArenaUsed(img1) + ArenaUsed(img2)) / threads;
+  Image newImage = AllocateImageHeader(new_width, new_height, capacity);
 
   // COMPLETE THE CODE
   // ...
-  for (uint32 h=0; h<new_height; h++) {
-    int s1 = GetSizeRLERowArray(img1->row[h]);
-    int s2 = GetSizeRLERowArray(img2->row[h]);
+  ReplicateJob job = {BeginRowStores(newImage, threads, capacity), newImage,
+                      img1, img2};
+  ParallelRows(threads, new_height, ReplicateRows, ReplicateCost, &job);
+  EndRowStores(newImage, job.store, threads);
+
+  if (img1->row_black != NULL && img2->row_black != NULL) {
+    uint32* row_black = NewCounts(new_height);
+    for (uint32 h=0; h<new_height; h++) {
+      row_black[h] = img1->row_black[h] + img2->row_black[h];
+    }
+    SetCounts(newImage, row_black);
+  }
 
-    int isEven = s1%2==0 ? 1:0;
-    int sameColor = img1->row[h][0] == img2->row[h][0] ? 1:0;  // img1 e img2 começam na mesma cor
+  return newImage;
+}
 
-    int n = s1 + s2 - (sameColor ? (isEven ? 2 : 3) : (isEven ? 3 : 2));
+typedef struct {
+  Image* store;  // the row store of each worker
+  Image dst;
+  Image img;
+  uint32 x, y;  // top left corner of the window in img
+} CropJob;
 
-    newImage->row[h] = AllocateRLERowArray(n);
+static uint32 CropCost(void* ctx, uint32 h) {
+  CropJob* job = ctx;
+  return GetNumRunsInRLERow(job->img->row[job->y + h].rle);
+}
 
-    int w1;
-    for (w1=0; w1<s1-1; w1++) { // copia elementos de img1->row até '-1' (exclusive)
-      newImage->row[h][w1] = img1->row[h][w1];
+static void CropRows(void* ctx, uint32 worker, uint32 first, uint32 last) {
+  CropJob* job = ctx;
+  Image img = job->img;
+  Image dst = job->dst;
+  uint32* runs = AllocateRunsBuffer(dst->width);
+
+  for (uint32 h = first; h < last; h++) {
+    RowRef row = img->row[job->y + h];
+    if (h > first && row.rle == img->row[job->y + h - 1].rle) {
+      // (The slice of a repeated row is repeated, negated if the row is)
+      uint8 neg = row.color ^ img->row[job->y + h - 1].color;
+      dst->row[h].rle = dst->row[h - 1].rle;
+      dst->row[h].color = dst->row[h - 1].color ^ neg;
+      dst->row_black[h] = neg ? dst->width - dst->row_black[h - 1]
+                              : dst->row_black[h - 1];
+      continue;
     }
+    uint8 color;
+    uint32 n = SliceRow(row, img->width, KnownRunEnds(img, job->y + h),
+                        job->x, job->x + dst->width, runs, &color);
+    dst->row[h].rle = StoreRLERow(job->store[worker], runs, n);
+    dst->row[h].color = color;
+    dst->row_black[h] = CountBlackRuns(runs, n, color);
+  }
+  free(runs);
+}
 
-    int w2 = 0;
-    if ((isEven && !sameColor) || (!isEven && sameColor)) {
-      newImage->row[h][w1-1] += img2->row[h][1];
-      w1--;
-      w2++;
+Image ImageCrop(const Image img, uint32 x, uint32 y, uint32 width,
+                uint32 height) {  ///
+  assert(img != NULL);
+  assert(width > 0 && x < img->width && width <= img->width - x);
+  assert(height > 0 && y < img->height && height <= img->height - y);
+
+  if (width == img->width) {
+    // (Whole rows: they are shared with img)
+    Image newImage = AllocateImageHeader(width, height, 0);
+    ShareArena(newImage, img);
+    memcpy(newImage->row, img->row + y, height * sizeof(RowRef));
+    if (img->row_black != NULL) {
+      uint32* row_black = NewCounts(height);
+      memcpy(row_black, img->row_black + y, height * sizeof(uint32));
+      SetCounts(newImage, row_black);
     }
+    return newImage;
+  }
 
-    while(w2<s2-1) {
-      newImage->row[h][w1+w2] = img2->row[h][w2+1];
-      w2++;
+  uint32 threads = ThreadsFor(height);
+  size_t capacity = ArenaUsed(img) / img->height * height / threads;
+  Image newImage = AllocateImageHeader(width, height, capacity);
+
+  newImage->row_black = NewCounts(height);
+  CropJob job = {BeginRowStores(newImage, threads, capacity), newImage,
+                 img, x, y};
+  ParallelRows(threads, height, CropRows, CropCost, &job);
+  EndRowStores(newImage, job.store, threads);
+  SetCounts(newImage, newImage->row_black);
+
+  return newImage;
+}
+
+/// Reverse the order of the rows of img (a horizontal mirror, in place).
+/// (Only for new images, whose hashes and run ends are not known.)
+static void ReverseRows(Image img) {
+  assert(img->row_hash == NULL && img->index == NULL);
+  if (img->height == 0) return;
+  for (uint32 i = 0, j = img->height - 1; i < j; i++, j--) {
+    RowRef row = img->row[i];
+    img->row[i] = img->row[j];
+    img->row[j] = row;
+    if (img->row_black != NULL) {
+      uint32 black = img->row_black[i];
+      img->row_black[i] = img->row_black[j];
+      img->row_black[j] = black;
+    }
+  }
+}
+
+Image ImageRotate180(const Image img) {  ///
+  assert(img != NULL);
+  // (The rows of the vertical mirror are new, so they are just reordered)
+  Image newImage = ImageVerticalMirror(img);
+  ReverseRows(newImage);
+  return newImage;
+}
+
+// Transposition
+//
+// Row x of the transpose of an image is its column x. The runs of the
+// columns are found by a sweep down the rows: the columns where a row
+// differs from the previous one (found by merging the run ends of both
+// rows) are exactly those where a column run ends, so the sweep only
+// keeps, for each column, where its current run started.
+// The work is proportional to the runs of the image and of its transpose.
+//
+// When the transpose has nearly as many runs as pixels (as for halftones
+// or noise), most of its rows would be BITMAP rows: the image is then
+// expanded to a bitmap, transposed in blocks of 8x8 pixels (one tile of
+// blocks at a time, to stay in cache), and stored row by row.
+
+// Transposed blocks in a tile (of TRANSPOSE_TILE x TRANSPOSE_TILE blocks)
+#define TRANSPOSE_TILE 16
+
+/// Transpose a block of 8x8 pixels: 8 bytes, the first one in the top byte.
+/// (Bit j of byte i goes to bit i of byte j, in PBM order.)
+static inline uint64 Transpose8x8(uint64 x) {
+  uint64 t;
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
+
+/// Mark column c, where a column run ends at step i of the sweep: with
+/// no runs buffer, count its runs; otherwise, store the run that ends.
+static inline void EndColumnRun(uint32 c, uint32 i, uint32* count,
+                                uint32* start, uint32* runs,
+                                const size_t* offset) {
+  if (runs != NULL) {
+    runs[offset[c] + count[c]] = i - start[c];
+    start[c] = i;
+  }
+  count[c]++;
+}
+
+/// Sweep the rows of img, top to bottom (or bottom to top, if reverse
+/// is 1), calling EndColumnRun for each column run that ends.
+///   ends : room for 2 * width run ends
+static void SweepColumns(const Image img, uint8 reverse, uint32* count,
+                         uint32* start, uint32* runs, const size_t* offset,
+                         uint32* ends) {
+  uint32 width = img->width;
+  uint32* prev_ends = ends;  // run ends of the previous row
+  uint32* cur_ends = ends + width;
+  uint32 prev_n = 0;
+  RowRef prev = {NULL, 0};
+
+  for (uint32 i = 0; i < img->height; i++) {
+    RowRef cur = img->row[reverse ? img->height - 1 - i : i];
+    if (i > 0 && cur.rle == prev.rle) {
+      // (A repeated row ends no runs; a negated one ends all of them)
+      if (cur.color != prev.color) {
+        for (uint32 c = 0; c < width; c++) {
+          EndColumnRun(c, i, count, start, runs, offset);
+        }
+        prev.color = cur.color;
+      }
+      continue;
+    }
+
+    // The run ends inside the row
+    uint32 n = cur.rle->num_runs - 1;
+    RunReader reader = ReadRuns(cur.rle, width);
+    uint32 end = 0;
+    for (uint32 k = 0; k < n; k++) {
+      end += NextRun(&reader);
+      cur_ends[k] = end;
+    }
+
+    if (i > 0) {
+      // The pixels that differ from the previous row end a column run
+      uint8 diff = cur.color ^ prev.color;
+      uint32 a = 0;
+      uint32 b = 0;
+      uint32 x = 0;
+      while (x < width) {
+        uint32 next = width;
+        if (a < prev_n && prev_ends[a] < next) next = prev_ends[a];
+        if (b < n && cur_ends[b] < next) next = cur_ends[b];
+        if (diff) {
+          for (uint32 c = x; c < next; c++) {
+            EndColumnRun(c, i, count, start, runs, offset);
+          }
+        }
+        if (a < prev_n && prev_ends[a] == next) {
+          a++;
+          diff ^= 1;
+        }
+        if (b < n && cur_ends[b] == next) {
+          b++;
+          diff ^= 1;
+        }
+        x = next;
+      }
+    }
+
+    uint32* swap = prev_ends;
+    prev_ends = cur_ends;
+    cur_ends = swap;
+    prev_n = n;
+    prev = cur;
+  }
+}
+
+typedef struct {
+  Image* store;     // the row store of each worker
+  Image dst;
+  uint32* runs;     // (sweep) runs of the columns
+  size_t* offset;   // (sweep) first run of each column
+  uint32* count;    // (sweep) number of runs of each column
+  uint8* color;     // (sweep) first pixel of each column
+  uint8* bits;      // (bitmap) the transposed bitmap
+  size_t stride;    // (bitmap) bytes per row of the transposed bitmap
+} TransposeJob;
+
+static uint32 TransposeCost(void* ctx, uint32 h) {
+  TransposeJob* job = ctx;
+  return job->bits != NULL ? 1 : job->count[h];
+}
+
+static void TransposeRows(void* ctx, uint32 worker, uint32 first,
+                          uint32 last) {
+  TransposeJob* job = ctx;
+  Image dst = job->dst;
+  uint32* runs = AllocateRunsBuffer(dst->width);
+
+  for (uint32 h = first; h < last; h++) {
+    if (job->bits != NULL) {
+      uint8* bits = job->bits + h * job->stride;
+      dst->row_black[h] = CountBits(bits, dst->width);
+      dst->row[h] = StoreBitmapRow(job->store[worker], bits, dst->width, runs);
+    } else {
+      const uint32* col = job->runs + job->offset[h];
+      dst->row[h].rle = StoreRLERow(job->store[worker], col, job->count[h]);
+      dst->row[h].color = job->color[h];
+      dst->row_black[h] = CountBlackRuns(col, job->count[h], job->color[h]);
+    }
+  }
+  free(runs);
+}
+
+/// Transpose img, taking its rows in reverse order if reverse is 1
+/// (which rotates it 90 degrees clockwise).
+static Image Transpose(const Image img, uint8 reverse) {
+  uint32 width = img->width;
+  uint32 height = img->height;
+  uint64 pixels = (uint64)width * height;
+
+  TransposeJob job = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0};
+
+  // Dense images (with a run per 8 pixels or more) go to the bitmap
+  uint64 num_runs = 0;
+  for (uint32 i = 0; i < height; i++) num_runs += img->row[i].rle->num_runs;
+  int dense = 8 * num_runs >= pixels;
+
+  uint32* ends = NULL;
+  if (!dense) {
+    // Count the runs of each column, and then find them
+    job.count = calloc(width, sizeof(uint32));
+    uint32* start = calloc(width, sizeof(uint32));
+    ends = AllocateRunsBuffer(2 * width);
+    check(job.count != NULL && start != NULL, "calloc");
+    SweepColumns(img, reverse, job.count, start, NULL, NULL, ends);
+
+    num_runs = 0;
+    for (uint32 c = 0; c < width; c++) num_runs += ++job.count[c];
+    dense = 8 * num_runs >= pixels;
+
+    if (!dense) {
+      job.offset = malloc(width * sizeof(size_t));
+      job.runs = malloc(num_runs * sizeof(uint32));
+      job.color = malloc(width);
+      check(job.offset != NULL && job.runs != NULL && job.color != NULL,
+            "malloc");
+      size_t offset = 0;
+      for (uint32 c = 0; c < width; c++) {
+        job.offset[c] = offset;
+        offset += job.count[c];
+        job.count[c] = 0;
+      }
+      SweepColumns(img, reverse, job.count, start, job.runs, job.offset,
+                   ends);
+
+      // Close the last run of each column, and find its first pixel
+      RowRef row = img->row[reverse ? height - 1 : 0];
+      RunReader reader = ReadRuns(row.rle, width);
+      uint8 color = row.color;
+      uint32 x = 0;
+      for (uint32 k = 0; k < row.rle->num_runs; k++, color ^= 1) {
+        uint32 end = x + NextRun(&reader);
+        for (; x < end; x++) job.color[x] = color;
+      }
+      for (uint32 c = 0; c < width; c++) {
+        EndColumnRun(c, height, job.count, start, job.runs, job.offset);
+      }
+    }
+    free(start);
+  }
+
+  if (dense) {
+    // Expand the rows to a bitmap, with a multiple of 8 rows
+    size_t in_stride = BitmapSize(width);
+    uint32 in_rows = (height + 7) / 8 * 8;
+    uint8* in = calloc(in_rows * in_stride, 1);
+    check(in != NULL, "calloc");
+    for (uint32 i = 0; i < height; i++) {
+      ExpandRow(img->row[reverse ? height - 1 - i : i], width,
+                in + i * in_stride);
+    }
+
+    job.stride = BitmapSize(height);
+    uint32 out_rows = (width + 7) / 8 * 8;
+    job.bits = calloc(out_rows * job.stride, 1);
+    check(job.bits != NULL, "calloc");
+
+    // Block (bi, bj): bytes bj of rows 8*bi..8*bi+7 of the image
+    uint32 block_rows = in_rows / 8;
+    uint32 block_cols = out_rows / 8;
+    for (uint32 ti = 0; ti < block_rows; ti += TRANSPOSE_TILE) {
+      for (uint32 tj = 0; tj < block_cols; tj += TRANSPOSE_TILE) {
+        for (uint32 bi = ti; bi < block_rows && bi < ti + TRANSPOSE_TILE; bi++) {
+          for (uint32 bj = tj; bj < block_cols && bj < tj + TRANSPOSE_TILE; bj++) {
+            const uint8* p = in + 8 * bi * in_stride + bj;
+            uint64 x = 0;
+            for (uint32 r = 0; r < 8; r++) x = x << 8 | p[r * in_stride];
+            x = Transpose8x8(x);
+            uint8* q = job.bits + 8 * bj * job.stride + bi;
+            for (uint32 r = 0; r < 8; r++) q[r * job.stride] = (uint8)(x >> (56 - 8 * r));
+          }
+        }
+      }
     }
+    free(in);
   }
+
+  uint32 threads = ThreadsFor(width);
+  size_t capacity = (dense ? pixels / 8 : 4 * num_runs) / threads + 64;
+  Image newImage = AllocateImageHeader(height, width, capacity);
+
+  // (The workers count the BLACK pixels of each new row, too)
+  newImage->row_black = NewCounts(width);
+  job.store = BeginRowStores(newImage, threads, capacity);
+  job.dst = newImage;
+  ParallelRows(threads, width, TransposeRows, TransposeCost, &job);
+  EndRowStores(newImage, job.store, threads);
+  SetCounts(newImage, newImage->row_black);
+
+  free(job.bits);
+  free(job.color);
+  free(job.runs);
+  free(job.offset);
+  free(job.count);
+  free(ends);
+  return newImage;
+}
+
+Image ImageTranspose(const Image img) {  ///
+  assert(img != NULL);
+  return Transpose(img, 0);
+}
+
+Image ImageRotate90(const Image img) {  ///
+  assert(img != NULL);
+  return Transpose(img, 1);
+}
+
+Image ImageRotate270(const Image img) {  ///
+  assert(img != NULL);
+  Image newImage = Transpose(img, 0);
+  ReverseRows(newImage);
   return newImage;
 }
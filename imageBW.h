@@ -19,6 +19,7 @@
 typedef uint8_t uint8;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
+typedef uint64_t uint64;
 
 // Type Image is a pointer to image objects
 typedef struct image* Image;
@@ -28,9 +29,28 @@ typedef struct image* Image;
 #define WHITE 0  // White pixel value
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation and set names of counters.
+/// If environment variable IMAGEBW_INTERN is set to a nonzero value,
+/// row interning is enabled (see ImageSetRowInterning).
+/// Environment variable IMAGEBW_THREADS sets the number of threads
+/// (see ImageSetThreads).
 void ImageInit(void);
 
+/// Enable (enable!=0) or disable (enable==0) row interning.
+/// When enabled, each image created afterwards stores every distinct row
+/// only once: rows equal to an already stored row reuse it.
+/// This saves memory (and time in ImageIsEqual) on images with many
+/// repeated rows, at the cost of hashing each new row.
+/// Disabled by default.
+void ImageSetRowInterning(int enable);
+
+/// Set the number of threads used by operations that process rows
+/// independently (boolean operations, mirrors, replicates, load and save).
+/// With n==0, use as many threads as online processors.
+/// The default is 1 (no threads are started).
+/// While row interning is enabled, operations use a single thread.
+void ImageSetThreads(uint32 n);
+
 /// Image management functions
 
 /// Create a new BW image, either BLACK or WHITE.
@@ -59,6 +79,14 @@ Image ImageCreate(uint32 width, uint32 height, uint8 val);
 Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
                             uint8 first_value);
 
+/// Create a copy of an image.
+/// The copy shares the compressed rows of img, which are never modified,
+/// so this takes time proportional to the height of the image only.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageClone(const Image img);
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -87,6 +115,78 @@ Image ImageLoad(const char* filename);
 /// On failure, does not return, EXITS program!
 int ImageSave(const Image img, const char* filename);
 
+/// Native RLE files (.rbw)
+
+/// An RBW file holds the compressed rows of an image as they are in memory,
+/// with an index of the rows and a checksum, so it is loaded with no
+/// decoding, and any range of rows can be loaded on its own.
+/// (The byte order is that of the machine that saved the file.)
+
+/// Save image to RBW file.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveRBW(const Image img, const char* filename);
+
+/// Load an RBW file, verifying its checksum.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadRBW(const char* filename);
+
+/// Load count rows of an RBW file, starting at row first,
+/// reading only those rows from the file.
+/// (The checksum of the file is not verified.)
+/// Requires: count > 0 and the rows are in the image.
+/// On success, a new image (with count rows) is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadRBWRows(const char* filename, uint32 first, uint32 count);
+
+/// Streaming PBM files
+
+/// A reader (writer) goes through the rows of a PBM file from top to bottom,
+/// a few rows at a time, so images larger than memory can be processed.
+/// The rows are held in images of the width of the file, and can be
+/// transformed with the operations into an existing image (ImageNEGInto,
+/// ImageANDInto, ..., ImageVerticalMirrorInto), which reuse their storage:
+/// a pipeline of streams takes memory proportional to the width only.
+typedef struct imageReader* ImageReader;
+typedef struct imageWriter* ImageWriter;
+
+/// Open a PBM file for reading, row by row.
+/// Only binary PBM files are accepted.
+/// (The caller is responsible for closing the returned reader!)
+ImageReader ImageReaderOpen(const char* filename);
+
+/// Get the width and the height of the image in the file of a reader
+uint32 ImageReaderWidth(const ImageReader r);
+uint32 ImageReaderHeight(const ImageReader r);
+
+/// Read the next rows of the file into image rows, replacing its pixels
+/// (and reusing its storage), as many as the height of rows.
+/// Requires: rows has the width of the file, and its height is at most
+/// the number of rows not read yet.
+void ImageReaderRead(ImageReader r, Image rows);
+
+/// Close the reader pointed to by (*rp).
+/// If (*rp)==NULL, no operation is performed.
+/// Ensures: (*rp)==NULL.
+void ImageReaderClose(ImageReader* rp);
+
+/// Create a PBM file for an image with the given size, to be written row by
+/// row.
+/// (The caller is responsible for closing the returned writer!)
+ImageWriter ImageWriterOpen(const char* filename, uint32 width, uint32 height);
+
+/// Write all the rows of image rows, after the rows already written.
+/// Requires: rows has the width of the file, and its height is at most
+/// the number of rows not written yet.
+void ImageWriterWrite(ImageWriter w, const Image rows);
+
+/// Close the writer pointed to by (*wp), flushing the file.
+/// Requires: all the rows of the image were written.
+/// If (*wp)==NULL, no operation is performed.
+/// Ensures: (*wp)==NULL.
+void ImageWriterClose(ImageWriter* wp);
+
 /// Information queries
 
 /// Get image width
@@ -95,12 +195,74 @@ int ImageWidth(const Image img);
 /// Get image height
 int ImageHeight(const Image img);
 
+/// Get the value (BLACK or WHITE) of pixel (x, y) of img.
+/// The first probe of a row records where its runs end, so that the
+/// following probes of the row take a binary search, O(log runs).
+/// Requires: x < width and y < height of img.
+uint8 ImageGetPixel(const Image img, uint32 x, uint32 y);
+
+/// Get the values of n pixels of img, at (x[i], y[i]), into values[i].
+/// Requires: the pixels are in the image.
+void ImageGetPixels(const Image img, uint32 n, const uint32 x[],
+                    const uint32 y[], uint8 values[]);
+
+/// Get the number of BLACK pixels of img.
+/// The count of each row is computed (from its runs) when first needed, and
+/// kept while the image does not change; the operations that derive an
+/// image from others (negation, mirrors, replicates, boolean operations)
+/// also derive the counts of its rows.
+uint64 ImageCountBlack(const Image img);
+
+/// Get the number of BLACK pixels of row y of img.
+/// Requires: y < height of img.
+uint32 ImageRowCountBlack(const Image img, uint32 y);
+
 /// Image comparison
 
+/// Get a 64-bit hash of the pixels of img.
+/// Equal images have equal hashes (so images with different hashes
+/// are different).
+/// The hash of each row, and of the image, is computed when first needed,
+/// and kept while the image does not change: comparisons between images
+/// already hashed reject most different images at once.
+uint64 ImageHash(const Image img);
+
 int ImageIsEqual(const Image img1, const Image img2);
 
 int ImageIsDifferent(const Image img1, const Image img2);
 
+/// Pixel editing
+
+/// These functions change pixels of an image in place.
+/// Only the rows they change are rewritten, each once per call, with a
+/// new version stored in the image (other images sharing the old rows
+/// are not affected); their cost is proportional to the runs of those
+/// rows, not to the size of the image.
+
+/// An edit: set the pixels of the rectangle of width x height pixels
+/// with top left corner (x, y) to color.
+typedef struct {
+  uint32 x, y;
+  uint32 width, height;
+  uint8 color;
+} ImageEdit;
+
+/// Set pixel (x, y) of img to color (BLACK or WHITE).
+/// Requires: x < width and y < height of img.
+void ImageSetPixel(Image img, uint32 x, uint32 y, uint8 color);
+
+/// Set the pixels of a rectangle of img to color (BLACK or WHITE).
+/// Requires: the rectangle is inside img.
+void ImageFillRect(Image img, uint32 x, uint32 y, uint32 width,
+                   uint32 height, uint8 color);
+
+/// Apply n edits to img, in order (where edits overlap, the last wins).
+/// Each row is decoded and stored once, whatever the number of edits
+/// covering it, and a run of equal rows under the same edits is edited
+/// once.
+/// Requires: the rectangles of the edits are inside img.
+void ImageApplyEdits(Image img, const ImageEdit edits[], uint32 n);
+
 /// Boolean Operations on image pixels
 
 /// These functions apply boolean operations to images,
@@ -119,6 +281,95 @@ Image ImageOR(const Image img1, const Image img2);
 
 Image ImageXOR(const Image img1, const Image img2);
 
+/// The 16 boolean operators on two pixels, p1 (from img1) and p2 (from img2).
+/// Each operator is its own truth table: bit (2*p1 + p2) of the operator
+/// is its value for pixels p1 and p2.
+typedef enum {
+  BOOL_FALSE = 0x0,    // 0
+  BOOL_NOR = 0x1,      // NOT (p1 OR p2)
+  BOOL_NOTAND = 0x2,   // (NOT p1) AND p2
+  BOOL_NOT1 = 0x3,     // NOT p1
+  BOOL_ANDNOT = 0x4,   // p1 AND (NOT p2)
+  BOOL_NOT2 = 0x5,     // NOT p2
+  BOOL_XOR = 0x6,      // p1 XOR p2
+  BOOL_NAND = 0x7,     // NOT (p1 AND p2)
+  BOOL_AND = 0x8,      // p1 AND p2
+  BOOL_XNOR = 0x9,     // NOT (p1 XOR p2)
+  BOOL_SECOND = 0xA,   // p2
+  BOOL_IMPLIES = 0xB,  // p1 IMPLIES p2 = (NOT p1) OR p2
+  BOOL_FIRST = 0xC,    // p1
+  BOOL_ORNOT = 0xD,    // p1 OR (NOT p2)
+  BOOL_OR = 0xE,       // p1 OR p2
+  BOOL_TRUE = 0xF,     // 1
+} BoolOp;
+
+/// Apply any boolean operator op to the pixels of img1 and img2.
+/// (ImageAND, ImageOR and ImageXOR are special cases.)
+Image ImageBoolOp(const Image img1, const Image img2, BoolOp op);
+
+/// Boolean Operations into an existing image
+
+/// These functions store the result of a boolean operation in the image dst,
+/// replacing its pixels and reusing its storage.
+/// Requires: dst and the operands have the same size.
+/// The destination may be one of the operands.
+
+/// Negate the pixels of img.
+void ImageNEGInPlace(Image img);
+
+void ImageNEGInto(Image dst, const Image img);
+
+void ImageANDInto(Image dst, const Image img1, const Image img2);
+
+void ImageORInto(Image dst, const Image img1, const Image img2);
+
+void ImageXORInto(Image dst, const Image img1, const Image img2);
+
+void ImageBoolOpInto(Image dst, const Image img1, const Image img2, BoolOp op);
+
+/// Paste src into dst, with its top left corner at pixel (x, y) of dst,
+/// replacing the pixels of dst it covers (the part of src outside dst is
+/// ignored).
+/// Only the rows of dst covered by src are rewritten, by splicing runs:
+/// the cost is proportional to the runs of those rows and of src.
+/// Requires: x <= width and y <= height of dst. (src may be dst.)
+void ImagePaste(Image dst, const Image src, uint32 x, uint32 y);
+
+/// Same as ImagePaste, but combining each pixel p1 of dst covered by src
+/// with the pixel p2 of src, with operator op (e.g., BOOL_OR stamps the
+/// BLACK pixels of src on dst).
+void ImagePasteOp(Image dst, const Image src, uint32 x, uint32 y,
+                  BoolOp op);
+
+/// Boolean reductions of many images
+
+/// These functions compute img[0] op img[1] op ... op img[k-1],
+/// merging the rows of the k images in a single pass,
+/// and return a new image as a result.
+/// Requires: k >= 1 and all the images have the same size.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+Image ImageReduceAND(const Image img[], uint32 k);
+
+Image ImageReduceOR(const Image img[], uint32 k);
+
+Image ImageReduceXOR(const Image img[], uint32 k);
+
+/// Maximum number of images of ImageBoolFunc
+#define IMAGE_BOOLFUNC_MAX 16
+
+/// Apply any boolean function of k pixels to k images, in a single pass.
+///   table : the truth table, with 2^k entries (0 or 1);
+///           entry m is the value for the pixels given by the bits of m
+///           (bit i is the pixel of img[i]).
+/// Requires: 1 <= k <= IMAGE_BOOLFUNC_MAX and all the images have the same size.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageBoolFunc(const Image img[], uint32 k, const uint8 table[]);
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -143,6 +394,11 @@ Image ImageHorizontalMirror(const Image img);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageVerticalMirror(const Image img);
 
+/// Mirror img left-right into the image dst, replacing its pixels
+/// and reusing its storage.
+/// Requires: dst and img have the same size. (dst may be img.)
+void ImageVerticalMirrorInto(Image dst, const Image img);
+
 /// Replicate img2 at the bottom of imag1, creating a larger image
 /// Requires: the width of the two images must be the same.
 /// Returns the new larger image.
@@ -161,4 +417,52 @@ Image ImageReplicateAtBottom(const Image img1, const Image img2);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageReplicateAtRight(const Image img1, const Image img2);
 
+/// Crop the rectangle of width x height pixels with top left corner (x, y)
+/// out of img.
+/// Each row is sliced from its runs (found by binary search, if the rows
+/// were indexed by pixel access), so the cost is proportional to the runs
+/// inside the rectangle; crops of whole rows share them with img.
+/// Requires: the rectangle is nonempty and inside img.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCrop(const Image img, uint32 x, uint32 y, uint32 width,
+                uint32 height);
+
+/// Transpose img: pixel (x, y) of the result is pixel (y, x) of img.
+/// The runs of the columns of img are found by a sweep down its rows,
+/// following where each row differs from the previous one, without
+/// decompressing the image (except for dense images, whose bitmap is
+/// transposed in cache-sized blocks).
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageTranspose(const Image img);
+
+/// Rotate img 90 degrees clockwise.
+/// (A transpose of the rows of img taken bottom to top.)
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageRotate90(const Image img);
+
+/// Rotate img 180 degrees.
+/// (A vertical mirror, whose rows are then taken in reverse order.)
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageRotate180(const Image img);
+
+/// Rotate img 270 degrees clockwise (90 degrees counterclockwise).
+/// (A transpose, whose rows are then taken in reverse order.)
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageRotate270(const Image img);
+
 #endif
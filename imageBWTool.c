@@ -30,15 +30,24 @@ static const char* USAGE =
     "  Most operations apply to CURR and some also use PRED.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in binary PBM format are accepted.\n"
+    "  Image files in binary PBM format are accepted, and also in the native\n"
+    "  RLE format, for files named *.rbw (which save also writes).\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load image from PBM file named FILE.\n"
     "  save FILE       Save CURR to PBM file named FILE.\n"
     "  info            Show information on CURR (size).\n"
+    "  count           Show the number of BLACK pixels of CURR.\n"
+    "  pixel X,Y       Show the value of pixel (X,Y) of CURR.\n"
+    "  setpixel X,Y,C  Set pixel (X,Y) of CURR to color C.\n"
+    "  fill X,Y,W,H,C  Set the WxH pixels at (X,Y) of CURR to color C.\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  lazy            Defer the pixel-wise operations and mirrors that follow,\n"
+    "                  until their result is needed, fusing them.\n"
+    "  stream          Same as lazy, but also defer loading the files that\n"
+    "                  follow: save then streams them row by row, if it can.\n"
     "\n"              
     "  create W,H,C    Create new image with WxH pixels, color C.\n"
     "  chess W,H,E,C   Create new chessboard image with WxH pixels,"
@@ -53,11 +62,20 @@ static const char* USAGE =
     "  and             PREV and CURR.\n"
     "  or              PREV or CURR.\n"
     "  xor             PREV xor CURR.\n"
+    "  boolop T        PREV T CURR, for any boolean operator T (0..15)\n"
+    "                  given by its truth table (8 = and, 14 = or, 6 = xor).\n"
+    "  boolopi T       Same as boolop T, but stored in place of CURR.\n"
+    "  reduce O,K      Reduce the last K images with O (and, or, xor).\n"
     "\n"              
     "  hmirror         Horizontal mirror CURR (flip top-bottom).\n"
     "  vmirror         Vertical mirror CURR (flip left-right).\n"
+    "  transpose       Transpose CURR (swap rows and columns).\n"
+    "  rotate D        Rotate CURR D degrees clockwise (90, 180, 270).\n"
     "  repb            Replicate CURR at the bottom of PREV.\n"
     "  repr            Replicate CURR at the right of PREV.\n"
+    "  crop X,Y,W,H    Crop the WxH pixels at (X,Y) out of CURR.\n"
+    "  paste X,Y,T     Paste CURR on a copy of PREV at (X,Y), combining pixels\n"
+    "                  with boolean operator T (10 = copy, 14 = or).\n"
     "\n"              
     "OPERANDS:\n"
     "  FILE            A filename\n"
@@ -75,6 +93,286 @@ static char* errors[] = {
   "Invalid operand",
 };
 
+// Deferred (lazy) evaluation
+//
+// After the "lazy" operation, the pixel-wise operations (neg, and, or, xor,
+// boolop) and the mirrors do not create images: they build an expression,
+// which is only evaluated when an operation needs the pixels of the image
+// (save, equal, raw, rle, ...).
+//
+// An expression is a boolean function of a few (materialized) leaf images,
+// given by its truth table, so negations and chains of boolean operations
+// are folded into a single table.
+// Mirrors commute with pixel-wise operations, so they are pushed down to
+// the leaves, where two equal mirrors cancel out.
+// The whole expression is then evaluated in a single pass over the rows
+// (by ImageBoolFunc), with no intermediate images.
+//
+// After the "stream" operation, files are not loaded either: they become
+// leaves of expressions. When such an expression is saved, and none of its
+// files is mirrored top-bottom, it is evaluated a row at a time, reading
+// the files and writing the result as it goes (in memory proportional to
+// the width of the images). Otherwise, the files are loaded when needed.
+
+#define LAZY_MAX_LEAVES 8
+
+typedef struct {
+  Image img;         // a materialized image
+  const char* file;  // or a PBM file, not loaded yet (if img is NULL)
+  uint8 hflip;       // mirrored top-bottom?
+  uint8 vflip;       // mirrored left-right?
+} Leaf;
+
+static int LeafEqual(const Leaf* a, const Leaf* b) {
+  return a->img == b->img && a->file == b->file && a->hflip == b->hflip &&
+         a->vflip == b->vflip;
+}
+
+typedef struct {
+  uint32 width, height;
+  uint32 num_leaves;
+  Leaf leaf[LAZY_MAX_LEAVES];
+  uint8 table[1 << LAZY_MAX_LEAVES];  // entry m: value for leaf pixels m
+} Expr;
+
+// Make an expression for image i of the buffer (deferred or not).
+static Expr* NewExpr(Image img[], Expr* lazy[], int i) {
+  Expr* e = malloc(sizeof(Expr));
+  if (e == NULL) { perror("malloc"); exit(2); }
+  if (lazy[i] != NULL) {
+    *e = *lazy[i];
+  } else {
+    e->width = ImageWidth(img[i]);
+    e->height = ImageHeight(img[i]);
+    e->num_leaves = 1;
+    e->leaf[0] = (Leaf){img[i], NULL, 0, 0};
+    e->table[0] = 0;
+    e->table[1] = 1;
+  }
+  return e;
+}
+
+// Make an expression for a PBM file (reading only its header).
+static Expr* FileExpr(const char* file) {
+  Expr* e = malloc(sizeof(Expr));
+  if (e == NULL) { perror("malloc"); exit(2); }
+  ImageReader r = ImageReaderOpen(file);
+  e->width = ImageReaderWidth(r);
+  e->height = ImageReaderHeight(r);
+  ImageReaderClose(&r);
+  e->num_leaves = 1;
+  e->leaf[0] = (Leaf){NULL, file, 0, 0};
+  e->table[0] = 0;
+  e->table[1] = 1;
+  return e;
+}
+
+static void ExprNeg(Expr* e) {
+  for (uint32 m = 0; m < (1u << e->num_leaves); m++) e->table[m] ^= 1;
+}
+
+static void ExprMirror(Expr* e, int vertical) {
+  for (uint32 i = 0; i < e->num_leaves; i++) {
+    if (vertical) e->leaf[i].vflip ^= 1;
+    else e->leaf[i].hflip ^= 1;
+  }
+}
+
+// Combine expression a with b, by boolean operator op (a truth table).
+// Returns 0 if the result would have too many leaves.
+static int ExprCombine(Expr* a, const Expr* b, uint32 op) {
+  Expr r = *a;
+  uint32 map[LAZY_MAX_LEAVES];  // map[j]: leaf of r for leaf j of b
+  for (uint32 j = 0; j < b->num_leaves; j++) {
+    uint32 i = 0;
+    while (i < r.num_leaves && !LeafEqual(&r.leaf[i], &b->leaf[j])) i++;
+    if (i == r.num_leaves) {
+      if (i == LAZY_MAX_LEAVES) return 0;
+      r.leaf[r.num_leaves++] = b->leaf[j];
+    }
+    map[j] = i;
+  }
+  for (uint32 m = 0; m < (1u << r.num_leaves); m++) {
+    uint32 ma = m & ((1u << a->num_leaves) - 1);  // (the leaves of a come first)
+    uint32 mb = 0;
+    for (uint32 j = 0; j < b->num_leaves; j++) mb |= ((m >> map[j]) & 1) << j;
+    r.table[m] = (op >> (2 * a->table[ma] + b->table[mb])) & 1;
+  }
+  *a = r;
+  return 1;
+}
+
+// Copy expression e to f, dropping the leaves the function does not
+// depend on.
+static void ExprSimplify(const Expr* e, Expr* f) {
+  *f = *e;
+  f->num_leaves = 0;
+  uint32 kept[LAZY_MAX_LEAVES];
+  for (uint32 i = 0; i < e->num_leaves; i++) {
+    uint32 m = 0;
+    while (m < (1u << e->num_leaves) && e->table[m] == e->table[m ^ (1u << i)]) m++;
+    if (m < (1u << e->num_leaves)) {
+      kept[f->num_leaves] = i;
+      f->leaf[f->num_leaves++] = e->leaf[i];
+    }
+  }
+  for (uint32 m = 0; m < (1u << f->num_leaves); m++) {
+    uint32 me = 0;
+    for (uint32 i = 0; i < f->num_leaves; i++) me |= ((m >> i) & 1) << kept[i];
+    f->table[m] = e->table[me];
+  }
+}
+
+// The boolean operator of an expression with 2 leaves.
+static BoolOp ExprBoolOp(const Expr* f) {
+  assert(f->num_leaves == 2);
+  uint32 op = 0;
+  for (uint32 p1 = 0; p1 < 2; p1++)
+    for (uint32 p2 = 0; p2 < 2; p2++)
+      op |= (uint32)f->table[p1 | (p2 << 1)] << (2 * p1 + p2);
+  return (BoolOp)op;
+}
+
+// Evaluate an expression, returning a new image.
+static Image ExprEvaluate(const Expr* e) {
+  Expr f;
+  ExprSimplify(e, &f);
+  if (f.num_leaves == 0) return ImageCreate(f.width, f.height, f.table[0]);
+
+  // The leaves, with their mirrors
+  Image leaf[LAZY_MAX_LEAVES];
+  uint8 temp[LAZY_MAX_LEAVES];  // leaf[i] is a temporary image?
+  for (uint32 i = 0; i < f.num_leaves; i++) {
+    leaf[i] = f.leaf[i].img;
+    temp[i] = 0;
+    if (leaf[i] == NULL) {
+      leaf[i] = ImageLoad(f.leaf[i].file);
+      temp[i] = 1;
+    }
+    if (f.leaf[i].vflip) {
+      Image t = ImageVerticalMirror(leaf[i]);
+      if (temp[i]) ImageDestroy(&leaf[i]);
+      leaf[i] = t;
+      temp[i] = 1;
+    }
+    if (f.leaf[i].hflip) {
+      Image t = ImageHorizontalMirror(leaf[i]);
+      if (temp[i]) ImageDestroy(&leaf[i]);
+      leaf[i] = t;
+      temp[i] = 1;
+    }
+  }
+
+  Image result;
+  if (f.num_leaves == 1) {
+    result = f.table[1] ? ImageClone(leaf[0]) : ImageNEG(leaf[0]);
+  } else if (f.num_leaves == 2) {
+    result = ImageBoolOp(leaf[0], leaf[1], ExprBoolOp(&f));
+  } else {
+    result = ImageBoolFunc(leaf, f.num_leaves, f.table);
+  }
+
+  for (uint32 i = 0; i < f.num_leaves; i++) {
+    if (temp[i]) ImageDestroy(&leaf[i]);
+  }
+  return result;
+}
+
+// Evaluate an expression a row at a time, saving it to a PBM file.
+// Returns 0 (doing nothing) if the expression cannot be streamed:
+// its leaves must be files of the same size, not mirrored top-bottom.
+static int ExprStream(const Expr* e, const char* filename) {
+  Expr f;
+  ExprSimplify(e, &f);
+  if (f.width == 0 || f.height == 0) return 0;
+  for (uint32 i = 0; i < f.num_leaves; i++) {
+    if (f.leaf[i].file == NULL || f.leaf[i].hflip) return 0;
+  }
+
+  ImageReader reader[LAZY_MAX_LEAVES];
+  Image row[LAZY_MAX_LEAVES];  // the current row of each file
+  for (uint32 i = 0; i < f.num_leaves; i++) {
+    reader[i] = ImageReaderOpen(f.leaf[i].file);
+    if (ImageReaderWidth(reader[i]) != f.width ||
+        ImageReaderHeight(reader[i]) != f.height) {
+      // (Let the operations report the error)
+      for (uint32 j = 0; j <= i; j++) ImageReaderClose(&reader[j]);
+      for (uint32 j = 0; j < i; j++) ImageDestroy(&row[j]);
+      return 0;
+    }
+    row[i] = ImageCreate(f.width, 1, 0);
+  }
+
+  ImageWriter writer = ImageWriterOpen(filename, f.width, f.height);
+  Image out = ImageCreate(f.width, 1, f.table[0]);  // the current result row
+  for (uint32 y = 0; y < f.height; y++) {
+    for (uint32 i = 0; i < f.num_leaves; i++) {
+      ImageReaderRead(reader[i], row[i]);
+      if (f.leaf[i].vflip) ImageVerticalMirrorInto(row[i], row[i]);
+    }
+    if (f.num_leaves == 0) {
+      ImageWriterWrite(writer, out);
+    } else if (f.num_leaves == 1) {
+      if (f.table[1]) {
+        ImageWriterWrite(writer, row[0]);
+      } else {
+        ImageNEGInto(out, row[0]);
+        ImageWriterWrite(writer, out);
+      }
+    } else if (f.num_leaves == 2) {
+      ImageBoolOpInto(out, row[0], row[1], ExprBoolOp(&f));
+      ImageWriterWrite(writer, out);
+    } else {
+      Image t = ImageBoolFunc(row, f.num_leaves, f.table);
+      ImageWriterWrite(writer, t);
+      ImageDestroy(&t);
+    }
+  }
+  ImageWriterClose(&writer);
+
+  ImageDestroy(&out);
+  for (uint32 i = 0; i < f.num_leaves; i++) {
+    ImageDestroy(&row[i]);
+    ImageReaderClose(&reader[i]);
+  }
+  return 1;
+}
+
+// Make sure image i of the buffer is materialized.
+static void Force(Image img[], Expr* lazy[], int i, FILE* log) {
+  if (lazy[i] == NULL) return;
+  fprintf(log, "Evaluate I%d (%u images)\n", i, lazy[i]->num_leaves);
+  img[i] = ExprEvaluate(lazy[i]);
+  free(lazy[i]);
+  lazy[i] = NULL;
+}
+
+// Defer image i op image j (op a truth table), returning its expression.
+static Expr* DeferBoolOp(Image img[], Expr* lazy[], int i, int j, uint32 op,
+                         FILE* log) {
+  Expr* a = NewExpr(img, lazy, i);
+  Expr* b = NewExpr(img, lazy, j);
+  if (!ExprCombine(a, b, op)) {
+    // Too many leaves: the operands become leaves
+    free(a);
+    free(b);
+    Force(img, lazy, i, log);
+    Force(img, lazy, j, log);
+    a = NewExpr(img, lazy, i);
+    b = NewExpr(img, lazy, j);
+    ExprCombine(a, b, op);
+  }
+  free(b);
+  return a;
+}
+
+
+// Is filename an RBW file (rather than PBM)?
+static int IsRBW(const char* filename) {
+  size_t len = strlen(filename);
+  return len >= 4 && strcmp(filename + len - 4, ".rbw") == 0;
+}
+
 
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
@@ -100,16 +398,67 @@ int main(int ac, char* av[]) {
   // The image buffer
   const int N = 10;   // buffer capacity
   Image img[N];       // the images
+  Expr* lazy[N];      // the deferred images (NULL if materialized)
   int n = 0;          // number of images created
+  int lazy_mode = 0;  // defer operations?
+  int stream_mode = 0;  // defer loading files?
+  for (int i = 0; i < N; i++) lazy[i] = NULL;
 
   int k = 1;
   while (k < ac) {
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
       fprintf(log, "Info on I%d\n", n-1);
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
+      if (lazy[n-1] != NULL) {
+        w = lazy[n-1]->width;
+        h = lazy[n-1]->height;
+      } else {
+        w = ImageWidth(img[n-1]);
+        h = ImageHeight(img[n-1]);
+      }
       fprintf(log, "# Size: %ux%u\n", w, h);
+    } else if (strcmp(av[k], "count") == 0) {
+      if (n < 1) { err = 2; break; }  // enough input images?
+      Force(img, lazy, n-1, log);
+      fprintf(log, "ImageCountBlack(I%d) -> %llu\n", n-1,
+              (unsigned long long)ImageCountBlack(img[n-1]));
+    } else if (strcmp(av[k], "pixel") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 1) { err = 2; break; }  // enough input images?
+      uint32 x, y;
+      if (sscanf(av[k], "%u,%u", &x, &y) != 2) { err = 4; break; }
+      Force(img, lazy, n-1, log);
+      if (x >= (uint32)ImageWidth(img[n-1]) || y >= (uint32)ImageHeight(img[n-1])) { err = 4; break; }   // precondition check!
+      fprintf(log, "ImageGetPixel(I%d, %u, %u) -> %u\n", n-1, x, y,
+              ImageGetPixel(img[n-1], x, y));
+    } else if (strcmp(av[k], "setpixel") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 1) { err = 2; break; }  // enough input images?
+      uint32 x, y, c;
+      if (sscanf(av[k], "%u,%u,%u", &x, &y, &c) != 3) { err = 4; break; }
+      Force(img, lazy, n-1, log);
+      if (x >= (uint32)ImageWidth(img[n-1]) || y >= (uint32)ImageHeight(img[n-1])) { err = 4; break; }   // precondition check!
+      if (c > 1) { err = 4; break; }   // precondition check!
+      fprintf(log, "ImageSetPixel(I%d, %u, %u, %u)\n", n-1, x, y, c);
+      ImageSetPixel(img[n-1], x, y, (uint8)c);
+    } else if (strcmp(av[k], "fill") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 1) { err = 2; break; }  // enough input images?
+      uint32 x, y, c;
+      if (sscanf(av[k], "%u,%u,%u,%u,%u", &x, &y, &w, &h, &c) != 5) { err = 4; break; }
+      Force(img, lazy, n-1, log);
+      if (x > (uint32)ImageWidth(img[n-1]) || w > (uint32)ImageWidth(img[n-1]) - x) { err = 4; break; }   // precondition check!
+      if (y > (uint32)ImageHeight(img[n-1]) || h > (uint32)ImageHeight(img[n-1]) - y) { err = 4; break; }   // precondition check!
+      if (c > 1) { err = 4; break; }   // precondition check!
+      fprintf(log, "ImageFillRect(I%d, %u, %u, %u, %u, %u)\n", n-1, x, y, w, h, c);
+      ImageFillRect(img[n-1], x, y, w, h, (uint8)c);
+    } else if (strcmp(av[k], "lazy") == 0) {
+      fprintf(log, "Lazy evaluation\n");
+      lazy_mode = 1;
+    } else if (strcmp(av[k], "stream") == 0) {
+      fprintf(log, "Streaming evaluation\n");
+      lazy_mode = 1;
+      stream_mode = 1;
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
@@ -136,75 +485,223 @@ int main(int ac, char* av[]) {
       n++;
     } else if (strcmp(av[k], "raw") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
+      Force(img, lazy, n-1, log);
       fprintf(log, "ImageRAWPrint(I%d)\n", n-1);
       ImageRAWPrint(img[n-1]);
     } else if (strcmp(av[k], "rle") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
+      Force(img, lazy, n-1, log);
       fprintf(log, "ImageRLEPrint(I%d)\n", n-1);
       ImageRLEPrint(img[n-1]);
     } else if (strcmp(av[k], "equal") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
+      Force(img, lazy, n-2, log);
+      Force(img, lazy, n-1, log);
       fprintf(log, "ImageIsEqual(I%d, I%d) -> ", n-2, n-1);
       int eq = ImageIsEqual(img[n-2], img[n-1]);
       fprintf(log, "%d\n", eq);
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageNEG(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageNEG(img[n-1]);
+      fprintf(log, "ImageNEG(I%d) -> I%d%s\n", n-1, n, lazy_mode ? " (deferred)" : "");
+      if (lazy_mode) {
+        img[n] = NULL;
+        lazy[n] = NewExpr(img, lazy, n-1);
+        ExprNeg(lazy[n]);
+      } else {
+        img[n] = ImageNEG(img[n-1]);
+      }
       n++;
     } else if (strcmp(av[k], "and") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageAND(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageAND(img[n-2], img[n-1]);
+      fprintf(log, "ImageAND(I%d, I%d) -> I%d%s\n", n-2, n-1, n, lazy_mode ? " (deferred)" : "");
+      if (lazy_mode) {
+        img[n] = NULL;
+        lazy[n] = DeferBoolOp(img, lazy, n-2, n-1, BOOL_AND, log);
+      } else {
+        img[n] = ImageAND(img[n-2], img[n-1]);
+      }
       n++;
     } else if (strcmp(av[k], "or") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageOR(img[n-2], img[n-1]);
+      fprintf(log, "ImageOR(I%d, I%d) -> I%d%s\n", n-2, n-1, n, lazy_mode ? " (deferred)" : "");
+      if (lazy_mode) {
+        img[n] = NULL;
+        lazy[n] = DeferBoolOp(img, lazy, n-2, n-1, BOOL_OR, log);
+      } else {
+        img[n] = ImageOR(img[n-2], img[n-1]);
+      }
       n++;
     } else if (strcmp(av[k], "xor") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageXOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageXOR(img[n-2], img[n-1]);
+      fprintf(log, "ImageXOR(I%d, I%d) -> I%d%s\n", n-2, n-1, n, lazy_mode ? " (deferred)" : "");
+      if (lazy_mode) {
+        img[n] = NULL;
+        lazy[n] = DeferBoolOp(img, lazy, n-2, n-1, BOOL_XOR, log);
+      } else {
+        img[n] = ImageXOR(img[n-2], img[n-1]);
+      }
+      n++;
+    } else if (strcmp(av[k], "boolop") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 2) { err = 2; break; }  // enough input images?
+      if (n >= N) { err = 3; break; } // enough space for output?
+      uint32 op;  // truth table
+      if (sscanf(av[k], "%u", &op) != 1) { err = 4; break; }
+      if (op > 15) { err = 4; break; }   // precondition check!
+      fprintf(log, "ImageBoolOp(I%d, I%d, %u) -> I%d%s\n", n-2, n-1, op, n, lazy_mode ? " (deferred)" : "");
+      if (lazy_mode) {
+        img[n] = NULL;
+        lazy[n] = DeferBoolOp(img, lazy, n-2, n-1, op, log);
+      } else {
+        img[n] = ImageBoolOp(img[n-2], img[n-1], (BoolOp)op);
+      }
+      n++;
+    } else if (strcmp(av[k], "boolopi") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 2) { err = 2; break; }  // enough input images?
+      uint32 op;  // truth table
+      if (sscanf(av[k], "%u", &op) != 1) { err = 4; break; }
+      if (op > 15) { err = 4; break; }   // precondition check!
+      Force(img, lazy, n-2, log);
+      Force(img, lazy, n-1, log);
+      fprintf(log, "ImageBoolOpInto(I%d, I%d, I%d, %u)\n", n-1, n-2, n-1, op);
+      ImageBoolOpInto(img[n-1], img[n-2], img[n-1], (BoolOp)op);
+    } else if (strcmp(av[k], "reduce") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n >= N) { err = 3; break; } // enough space for output?
+      char op[4];  // the operation
+      uint32 num;  // number of images
+      if (sscanf(av[k], "%3[a-z],%u", op, &num) != 2) { err = 4; break; }
+      if (num < 1) { err = 4; break; }   // precondition check!
+      if (n < (int)num) { err = 2; break; }  // enough input images?
+      for (int i = n - (int)num; i < n; i++) Force(img, lazy, i, log);
+      fprintf(log, "ImageReduce%s(I%d..I%d) -> I%d\n", op, n-(int)num, n-1, n);
+      if (strcmp(op, "and") == 0) {
+        img[n] = ImageReduceAND(img + n - num, num);
+      } else if (strcmp(op, "or") == 0) {
+        img[n] = ImageReduceOR(img + n - num, num);
+      } else if (strcmp(op, "xor") == 0) {
+        img[n] = ImageReduceXOR(img + n - num, num);
+      } else { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "hmirror") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageHorizontalMirror(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageHorizontalMirror(img[n-1]);
+      fprintf(log, "ImageHorizontalMirror(I%d) -> I%d%s\n", n-1, n, lazy_mode ? " (deferred)" : "");
+      if (lazy_mode) {
+        img[n] = NULL;
+        lazy[n] = NewExpr(img, lazy, n-1);
+        ExprMirror(lazy[n], 0);
+      } else {
+        img[n] = ImageHorizontalMirror(img[n-1]);
+      }
       n++;
     } else if (strcmp(av[k], "vmirror") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageVerticalMirror(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageVerticalMirror(img[n-1]);
+      fprintf(log, "ImageVerticalMirror(I%d) -> I%d%s\n", n-1, n, lazy_mode ? " (deferred)" : "");
+      if (lazy_mode) {
+        img[n] = NULL;
+        lazy[n] = NewExpr(img, lazy, n-1);
+        ExprMirror(lazy[n], 1);
+      } else {
+        img[n] = ImageVerticalMirror(img[n-1]);
+      }
       n++;
     } else if (strcmp(av[k], "repb") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
+      Force(img, lazy, n-2, log);
+      Force(img, lazy, n-1, log);
       fprintf(log, "ImageReplicateAtBottom(I%d, I%d) -> I%d\n", n-2, n-1, n);
       img[n] = ImageReplicateAtBottom(img[n-2], img[n-1]);
       n++;
     } else if (strcmp(av[k], "repr") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
+      Force(img, lazy, n-2, log);
+      Force(img, lazy, n-1, log);
       fprintf(log, "ImageReplicateAtRight(I%d, I%d) -> I%d\n", n-2, n-1, n);
       img[n] = ImageReplicateAtRight(img[n-2], img[n-1]);
       n++;
+    } else if (strcmp(av[k], "transpose") == 0) {
+      if (n < 1) { err = 2; break; }  // enough input images?
+      if (n >= N) { err = 3; break; } // enough space for output?
+      Force(img, lazy, n-1, log);
+      fprintf(log, "ImageTranspose(I%d) -> I%d\n", n-1, n);
+      img[n] = ImageTranspose(img[n-1]);
+      n++;
+    } else if (strcmp(av[k], "rotate") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 1) { err = 2; break; }  // enough input images?
+      if (n >= N) { err = 3; break; } // enough space for output?
+      uint32 d;  // degrees
+      if (sscanf(av[k], "%u", &d) != 1) { err = 4; break; }
+      if (d != 90 && d != 180 && d != 270) { err = 4; break; }   // precondition check!
+      Force(img, lazy, n-1, log);
+      fprintf(log, "ImageRotate%u(I%d) -> I%d\n", d, n-1, n);
+      img[n] = d == 90 ? ImageRotate90(img[n-1])
+             : d == 180 ? ImageRotate180(img[n-1]) : ImageRotate270(img[n-1]);
+      n++;
+    } else if (strcmp(av[k], "crop") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 1) { err = 2; break; }  // enough input images?
+      if (n >= N) { err = 3; break; } // enough space for output?
+      uint32 x, y;
+      if (sscanf(av[k], "%u,%u,%u,%u", &x, &y, &w, &h) != 4) { err = 4; break; }
+      Force(img, lazy, n-1, log);
+      if (w == 0 || x >= (uint32)ImageWidth(img[n-1]) || w > (uint32)ImageWidth(img[n-1]) - x) { err = 4; break; }   // precondition check!
+      if (h == 0 || y >= (uint32)ImageHeight(img[n-1]) || h > (uint32)ImageHeight(img[n-1]) - y) { err = 4; break; }   // precondition check!
+      fprintf(log, "ImageCrop(I%d, %u, %u, %u, %u) -> I%d\n", n-1, x, y, w, h, n);
+      img[n] = ImageCrop(img[n-1], x, y, w, h);
+      n++;
+    } else if (strcmp(av[k], "paste") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 2) { err = 2; break; }  // enough input images?
+      if (n >= N) { err = 3; break; } // enough space for output?
+      uint32 x, y, op;
+      if (sscanf(av[k], "%u,%u,%u", &x, &y, &op) != 3) { err = 4; break; }
+      if (op > 15) { err = 4; break; }   // precondition check!
+      Force(img, lazy, n-2, log);
+      Force(img, lazy, n-1, log);
+      if (x > (uint32)ImageWidth(img[n-2]) || y > (uint32)ImageHeight(img[n-2])) { err = 4; break; }   // precondition check!
+      fprintf(log, "ImagePasteOp(I%d, I%d, %u, %u, %u) -> I%d\n", n-2, n-1, x, y, op, n);
+      img[n] = ImageClone(img[n-2]);
+      ImagePasteOp(img[n], img[n-1], x, y, (BoolOp)op);
+      n++;
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }  // enough input images?
-      fprintf(log, "ImageSave(I%d, \"%s\")\n", n-1, av[k]);
-      ImageSave(img[n-1], av[k]);
+      if (stream_mode && lazy[n-1] != NULL && !IsRBW(av[k]) &&
+          ExprStream(lazy[n-1], av[k])) {
+        fprintf(log, "Stream I%d to \"%s\"\n", n-1, av[k]);
+      } else if (IsRBW(av[k])) {
+        Force(img, lazy, n-1, log);
+        fprintf(log, "ImageSaveRBW(I%d, \"%s\")\n", n-1, av[k]);
+        ImageSaveRBW(img[n-1], av[k]);
+      } else {
+        Force(img, lazy, n-1, log);
+        fprintf(log, "ImageSave(I%d, \"%s\")\n", n-1, av[k]);
+        ImageSave(img[n-1], av[k]);
+      }
     } else {  // image file
       if (n >= N) { err = 3; break; }
-      fprintf(log, "ImageLoad(\"%s\") -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      //x if (img[n] == NULL) { err = 999; break; }
+      if (IsRBW(av[k])) {
+        fprintf(log, "ImageLoadRBW(\"%s\") -> I%d\n", av[k], n);
+        img[n] = ImageLoadRBW(av[k]);
+      } else if (stream_mode) {
+        fprintf(log, "ImageReaderOpen(\"%s\") -> I%d (deferred)\n", av[k], n);
+        img[n] = NULL;
+        lazy[n] = FileExpr(av[k]);
+      } else {
+        fprintf(log, "ImageLoad(\"%s\") -> I%d\n", av[k], n);
+        img[n] = ImageLoad(av[k]);
+        //x if (img[n] == NULL) { err = 999; break; }
+      }
       n++;
     }
     k++;
@@ -213,7 +710,8 @@ int main(int ac, char* av[]) {
   // Destroy remaining images
   while (n > 0) {
     fprintf(log, "ImageDestroy(I%d)\n", n-1);
-    ImageDestroy(&img[--n]);
+    free(lazy[--n]);
+    ImageDestroy(&img[n]);
   }
 
   if (err > 0) {